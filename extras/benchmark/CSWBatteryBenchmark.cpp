@@ -0,0 +1,231 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryBenchmark.cpp
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Benchmark of the hot paths of CSWBattery on the Linux host against
+  *          the synthetic traces (see CSWBatteryHAL.h for the simulator).
+  *          One JSON object per line is printed for every path and trace:
+  *          {"bench":"tick","trace":"discharge","ops":...,"ns_per_op":...,
+  *           "adc_reads_per_op":...,"delay_ms_per_op":...,"allocs_per_op":...}
+  *
+  *          Build and run from the root of the library:
+  *          g++ -std=gnu++11 -O2 -Isrc extras/benchmark/CSWBatteryBenchmark.cpp $(find src -name '*.cpp') -o cswbattery_benchmark -pthread
+  *          ./cswbattery_benchmark [ops] [bench name]
+  *          The noisy_step check ({"check":"noisy_step",...,"ok":...}) fails the run
+  *          with the exit code 1.
+  *
+  ******************************************************************************
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include "CSWBattery.h"
+#include "CSWBatteryBatch.h"
+
+////////////////////////////////////////////////////////////////////////
+// Allocations
+////////////////////////////////////////////////////////////////////////
+static std::atomic<unsigned long> allocations(0);
+
+// never inlined - otherwise the compiler sees malloc() and free() paired with new and delete (-Wmismatched-new-delete)
+
+__attribute__((noinline)) void * operator new(size_t size) {
+  allocations++;
+  void * __p = malloc(size ? size : 1);
+  if(__p == NULL) throw std::bad_alloc();
+  return __p;
+}
+__attribute__((noinline)) void * operator new[](size_t size) {
+  allocations++;
+  void * __p = malloc(size ? size : 1);
+  if(__p == NULL) throw std::bad_alloc();
+  return __p;
+}
+__attribute__((noinline)) void operator delete(void * p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void * p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void * p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void * p, size_t) noexcept { free(p); }
+
+////////////////////////////////////////////////////////////////////////
+// Traces (raw ADC counts; 12 bits, battery coefficient 1.1 -> ~1.77 mV per count)
+////////////////////////////////////////////////////////////////////////
+#define RAW_4V20 2370
+#define RAW_3V60 2030
+#define RAW_CHARGER 2480
+#define RAW_STEP_FROM 2300
+#define RAW_STEP_TO 2100
+#define TRACE_DURATION_MS (8UL * 3600 * 1000)
+
+struct trace {
+  const char *  name;
+  CSWBatteryAdcSource source;
+  void *        param;
+};
+
+// full discharge 4.2V -> 3.6V, a little noise
+static CSWBatterySimAdcScript dischargeScript(1);
+// on the charger - the pin sees the charger voltage after the first half an hour
+static CSWBatterySimAdcScript chargingScript(2);
+// stable voltage, noisy ADC
+static CSWBatterySimAdcScript noisyScript(3);
+
+// discharge with the short voltage drops under the load (radio bursts): 200 ms every 5 s
+static int loadSpikesSource(void * param, int pin, uint64_t now_us) {
+  (void)param;
+  (void)pin;
+  int __raw = dischargeScript.getValue(now_us);
+  if((now_us / 1000) % 5000 < 200) __raw -= 170;
+  return __raw;
+}
+
+static trace traces[] = {
+  {"discharge",   CSWBatterySimAdcScript::source, &dischargeScript},
+  {"charging",    CSWBatterySimAdcScript::source, &chargingScript},
+  {"noisy",       CSWBatterySimAdcScript::source, &noisyScript},
+  {"load_spikes", loadSpikesSource,               NULL}
+};
+
+static void initTraces(void) {
+  dischargeScript.addRamp(TRACE_DURATION_MS, RAW_4V20, RAW_3V60, 3);
+  chargingScript.addRamp(1800UL * 1000, RAW_3V60, RAW_4V20, 3);
+  chargingScript.addHold(TRACE_DURATION_MS, RAW_CHARGER, 3);
+  noisyScript.addHold(TRACE_DURATION_MS, (RAW_4V20 + RAW_3V60) / 2, 40);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Benchmarks
+////////////////////////////////////////////////////////////////////////
+typedef void (*BenchFunction) (CSWBattery& battery);
+
+struct bench {
+  const char *  name;
+  BenchFunction run;
+  unsigned long interval_ms;  // virtual time between the calls
+  bool          collecting;   // average data receiving type
+};
+
+static volatile float sink;
+
+static void benchGetBatteryVoltage(CSWBattery& battery) { sink = battery.getBatteryVoltage(); }
+static void benchChangedSections(CSWBattery& battery) { sink = battery.checkBatteryVoltageChanged(1, true); }
+static void benchChangedPercentage(CSWBattery& battery) { sink = battery.checkBatteryVoltageChanged(2, true); }
+static void benchChangedVoltage(CSWBattery& battery) { sink = battery.checkBatteryVoltageChanged(3, true); }
+static void benchCheckIfEmpty(CSWBattery& battery) { sink = battery.checkIfEmpty(); }
+static void benchTick(CSWBattery& battery) { battery.tick(); }
+
+static bench benches[] = {
+  {"getBatteryVoltage",               benchGetBatteryVoltage, 1000,  false},
+  {"checkBatteryVoltageChanged_1",    benchChangedSections,   1000,  false},
+  {"checkBatteryVoltageChanged_2",    benchChangedPercentage, 1000,  false},
+  {"checkBatteryVoltageChanged_3",    benchChangedVoltage,    1000,  false},
+  {"checkIfEmpty",                    benchCheckIfEmpty,      1000,  false},
+  {"tick",                            benchTick,              CSWBATTERY_TIME_RECHECK_S * 1000UL, true}
+};
+
+static void runBench(const bench& b, const trace& t, unsigned long ops) {
+  CSWBatterySim __sim;
+  __sim.setAdcSource(t.source, t.param);
+  __sim.setAdcReadCostUs(10);
+  CSWBattery __battery(34, 2);
+  if(b.collecting) {
+    __battery.setBatteryStatsReceivingType(CSWBattery::averageReceive);
+    // the benchmark does the ticks itself
+    __battery.stopCollectingData();
+  }
+  // the trace has to last for all the calls
+  unsigned long __step_ms = b.interval_ms;
+  if(__step_ms * ops > TRACE_DURATION_MS) __step_ms = TRACE_DURATION_MS / ops;
+  __battery.resetStats();
+  unsigned long __allocations = 0;
+  std::chrono::steady_clock::duration __elapsed(0);
+  for(unsigned long i=0;i<ops;i++) {
+    unsigned long __a = allocations.load();
+    std::chrono::steady_clock::time_point __start = std::chrono::steady_clock::now();
+    b.run(__battery);
+    __elapsed += std::chrono::steady_clock::now() - __start;
+    __allocations += allocations.load() - __a;
+    __sim.advance(__step_ms);
+  }
+  batteryStats __stats = __battery.getStats();
+  double __ns = std::chrono::duration<double, std::nano>(__elapsed).count();
+  printf("{\"bench\":\"%s\",\"trace\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.1f,\"adc_reads_per_op\":%.2f,\"delay_ms_per_op\":%.2f,\"allocs_per_op\":%.3f,\"fluke_rejections\":%u}\n",
+    b.name, t.name, ops, __ns / ops, (double)__stats.analog_reads / ops, (double)__stats.delay_ms / ops,
+    (double)__allocations / ops, __stats.fluke_rejections);
+}
+
+// The step of the voltage on the noisy ADC has to be reported by checkBatteryVoltageChanged(),
+// and the noise around the new voltage has to be told from it (as the flukes)
+static bool runNoisyStepCheck(void) {
+  bool __ok = true;
+  for(int __type=1;__type<=3;__type++) {
+    CSWBatterySim __sim;
+    CSWBatterySimAdcScript __script(4);
+    __script.addHold(60UL * 1000, RAW_STEP_FROM, 40);
+    __script.addHold(60UL * 1000, RAW_STEP_TO, 40);
+    __sim.setAdcSource(CSWBatterySimAdcScript::source, &__script);
+    CSWBattery __battery(34, 2);
+    float __step_v = __battery.convertRawToVoltage(RAW_STEP_TO, __battery.getBatteryCoefficient(), 3);
+    int __step_changes = 0;
+    int __noise_changes = 0;
+    double __error = 0;
+    for(int i=0;i<120;i++) {
+      bool __changed = __battery.checkBatteryVoltageChanged(__type, true);
+      if((i >= 60) && (i < 65)) __step_changes += __changed;
+      if(i >= 65) {
+        __noise_changes += __changed;
+        __error += fabs(__battery.getLastBatteryVoltage() - __step_v);
+      }
+      __sim.advance(1000);
+    }
+    __error /= 55;
+    // the step is seen within 5 s, then the last voltage stays close to the new one
+    bool __res = (__step_changes >= 1) && (__error <= 0.05);
+    __ok = __ok && __res;
+    printf("{\"check\":\"noisy_step\",\"check_type\":%d,\"step_changes\":%d,\"noise_changes\":%d,\"fluke_rejections\":%u,\"mean_error_v\":%.3f,\"ok\":%s}\n",
+      __type, __step_changes, __noise_changes, __battery.getStats().fluke_rejections, __error, __res ? "true" : "false");
+  }
+  return __ok;
+}
+
+// CSWBatteryBatch over the readings of the discharge trace, one line per kernel
+static void runBatchBench(unsigned long ops) {
+  static const char * names[] = {"scalar", "sse41", "avx2"};
+  CSWBatterySim __sim;
+  std::vector<uint16_t> __raw(ops * 1000);
+  for(size_t i=0;i<__raw.size();i++) __raw[i] = dischargeScript.getValue((uint64_t)i * TRACE_DURATION_MS * 1000 / __raw.size());
+  std::vector<int32_t> __mv(__raw.size());
+  std::vector<int8_t> __percentage(__raw.size());
+  std::vector<int8_t> __section(__raw.size());
+  CSWBattery __battery(34, 2);
+  CSWBatteryBatch __batch(__battery);
+  for(int k=CSWBatteryBatch::KERNEL_SCALAR;k<=CSWBatteryBatch::KERNEL_AVX2;k++) {
+    if(!__batch.setKernel(k)) continue;
+    std::chrono::steady_clock::time_point __start = std::chrono::steady_clock::now();
+    __batch.convert(__raw.data(), __raw.size(), __mv.data(), __percentage.data(), __section.data());
+    double __ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - __start).count();
+    printf("{\"bench\":\"convertBatch\",\"kernel\":\"%s\",\"samples\":%zu,\"ns_per_sample\":%.3f}\n", names[k], __raw.size(), __ns / __raw.size());
+  }
+}
+
+int main(int argc, char ** argv) {
+  unsigned long __ops = (argc > 1) ? strtoul(argv[1], NULL, 10) : 2000;
+  const char * __only = (argc > 2) ? argv[2] : NULL;
+  if(__ops == 0) __ops = 1;
+  initTraces();
+  for(size_t i=0;i<sizeof(benches)/sizeof(benches[0]);i++) {
+    if((__only != NULL) && (strcmp(__only, benches[i].name) != 0)) continue;
+    for(size_t j=0;j<sizeof(traces)/sizeof(traces[0]);j++) runBench(benches[i], traces[j], __ops);
+  }
+  if((__only == NULL) || (strcmp(__only, "convertBatch") == 0)) runBatchBench(__ops);
+  if((__only == NULL) || (strcmp(__only, "noisy_step") == 0)) {
+    if(!runNoisyStepCheck()) return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,353 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryFleet.cpp
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Analyzes the directory of the traces recorded by CSWBatteryTraceRecorder
+  *          on all the cores: every trace is replayed through CSWBattery (see
+  *          CSWBatteryReplay.cpp) by the pool of the workers which steal the traces
+  *          from each other, every worker with its own simulator.
+  *
+  *          Build from the root of the library:
+  *          g++ -std=gnu++11 -O2 -Isrc extras/fleet/CSWBatteryFleet.cpp $(find src -name '*.cpp') -o cswbattery_fleet -pthread
+  *
+  *          cswbattery_fleet dir [--threads N] [--precision N] [--check-times N] [--low N]
+  *            the traces are dir/device/any.bin or dir/device_any.bin, the traces of the
+  *            device are taken in the order of their names. One JSON object is printed
+  *            per device, the summary is the last line:
+  *            {"device":"...","traces":...,"hours":...,"low_minutes":...,"low_entries":...,
+  *             "empty_events":...,"false_empty":...,"runtime_h":[first,last],"fade_pct_per_trace":...}
+  *            runtime_h is the discharge from 100% to 0% projected from the trace; its trend
+  *            over the traces is the capacity fade. The empty battery which comes back
+  *            without the charger (for 10 minutes at least) is the false empty; the low
+  *            battery is left the same way. --precision and --check-times are
+  *            for the traces of version 1 only, the newer ones carry their settings.
+  *
+  ******************************************************************************
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "CSWBattery.h"
+
+// the percentage has to go this much above the low one before it is entered again
+#define LOW_HYSTERESIS_PCT 5
+// the battery has to stay above the low one (or not empty) this long to leave it - the voltage
+// at the threshold flickers between the two steps of the precision, that is still the same entry
+#define SETTLE_MS (10UL * 60 * 1000)
+
+struct options {
+  int           precision=1;
+  int           check_times=5;
+  int           low=20;
+};
+
+struct traceResult {
+  std::string   device;
+  std::string   path;
+  bool          ok=false;
+  unsigned long ticks=0;
+  unsigned long duration_ms=0;
+  unsigned long discharge_ms=0;
+  long          discharged_pct=0;
+  unsigned long low_ms=0;
+  unsigned long low_entries=0;
+  unsigned long empty_events=0;
+  unsigned long false_empty=0;
+};
+
+////////////////////////////////////////////////////////////////////////
+// One trace
+////////////////////////////////////////////////////////////////////////
+// state of the battery between the events of the replay
+struct traceState {
+  traceResult * result;
+  int           low;
+  bool          started=false;
+  unsigned long last_ms=0;
+  int           percentage=-1;
+  bool          charging=false;
+  bool          empty=false;
+  bool          empty_pending=false;  // reported empty, no charger since
+  bool          empty_left=false;     // came back from the empty one, not for SETTLE_MS yet
+  unsigned long empty_left_ms=0;
+  bool          low_left=true;        // the percentage went above the low one (+ the hysteresis) since the last entry
+  bool          low_leaving=false;    // above it, not for SETTLE_MS yet
+  unsigned long low_leaving_ms=0;
+  int           discharge_from=-1;    // percentage at the start of the discharge
+
+  // the percentage lost since the discharge (or the trace) started
+  void endDischarge(void) {
+    if((discharge_from >= 0) && (percentage >= 0) && (discharge_from > percentage)) result->discharged_pct += discharge_from - percentage;
+    discharge_from = -1;
+  }
+
+  void advance(unsigned long tm) {
+    unsigned long __dt = started ? tm - last_ms : 0;
+    if(!charging) result->discharge_ms += __dt;
+    if((!charging) && (percentage >= 0) && (percentage <= low)) result->low_ms += __dt;
+    if(low_leaving && (tm - low_leaving_ms >= SETTLE_MS)) {
+      low_left = true;
+      low_leaving = false;
+    }
+    if(empty_left && (tm - empty_left_ms >= SETTLE_MS)) {
+      result->false_empty++;
+      empty_pending = false;
+      empty_left = false;
+    }
+    last_ms = tm;
+    started = true;
+  }
+};
+
+static void onEvent(void * param, const batteryReplayEvent& e) {
+  traceState * __s = static_cast<traceState *>(param);
+  __s->advance(e.time_ms);
+  switch(e.type) {
+    case CSWBatteryTraceReplay::EVENT_PERCENTAGE:
+      if((e.value >= 0) && (!__s->charging) && (__s->discharge_from < 0)) __s->discharge_from = e.value;
+      if((e.value >= 0) && (e.value <= __s->low) && __s->low_left) {
+        __s->result->low_entries++;
+        __s->low_left = false;
+      }
+      if((e.value > __s->low + LOW_HYSTERESIS_PCT) && (!__s->low_left) && (!__s->low_leaving)) {
+        __s->low_leaving = true;
+        __s->low_leaving_ms = e.time_ms;
+      } else if((e.value >= 0) && (e.value <= __s->low + LOW_HYSTERESIS_PCT)) {
+        __s->low_leaving = false;
+      }
+      __s->percentage = e.value;
+      break;
+    case CSWBatteryTraceReplay::EVENT_CHARGING:
+      if(e.value) __s->endDischarge();
+      __s->charging = e.value;
+      if(__s->charging) {
+        __s->empty_pending = false;
+        __s->empty_left = false;
+      }
+      break;
+    case CSWBatteryTraceReplay::EVENT_EMPTY:
+      if(e.value && (!__s->empty)) {
+        // empty again soon after it came back - still the same one
+        if(!__s->empty_left) __s->result->empty_events++;
+        __s->empty_pending = true;
+        __s->empty_left = false;
+      } else if((!e.value) && __s->empty_pending) {
+        __s->empty_left = true;
+        __s->empty_left_ms = e.time_ms;
+      }
+      __s->empty = e.value;
+      break;
+  }
+}
+
+static bool readFile(const std::string& path, std::vector<uint8_t>& data) {
+  FILE * __f = fopen(path.c_str(), "rb");
+  if(__f == NULL) return false;
+  uint8_t __buf[65536];
+  size_t __n;
+  while((__n = fread(__buf, 1, sizeof(__buf), __f)) > 0) data.insert(data.end(), __buf, __buf + __n);
+  fclose(__f);
+  return true;
+}
+
+// runs in the worker thread - on the simulator of the worker
+static void analyzeTrace(traceResult& r, const options& o) {
+  std::vector<uint8_t> __data;
+  if(!readFile(r.path, __data)) return;
+  CSWBatteryTraceReader __reader(__data.data(), __data.size());
+  if(!__reader.checkIfValid()) return;
+  batteryTraceEntry __e;
+  unsigned long __end_ms = __reader.getStartTime();
+  while(__reader.next(__e)) __end_ms = __e.time_ms;
+  CSWBattery __battery(34, o.precision);
+  __battery.setBatteryCheckTimes(o.check_times);
+  CSWBatteryTraceReplay __replay(__battery, __reader);
+  traceState __state;
+  __state.result = &r;
+  __state.low = o.low;
+  r.ticks = __replay.run(onEvent, &__state);
+  __state.advance(__end_ms);
+  __state.endDischarge();
+  r.duration_ms = __end_ms - __reader.getStartTime();
+  r.ok = true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Work-stealing pool: every worker takes the traces from the back of its own
+// queue and steals from the front of the others when it runs out
+////////////////////////////////////////////////////////////////////////
+class workerPool {
+  public:
+    workerPool(std::vector<traceResult>& results, const options& o, int workers) : _results(results), _options(o), _queues(workers) {
+      for(size_t i=0;i<results.size();i++) _queues[i % workers].tasks.push_back(i);
+    }
+    void run(void) {
+      std::vector<std::thread> __threads;
+      for(size_t i=0;i<_queues.size();i++) __threads.push_back(std::thread(&workerPool::work, this, i));
+      for(size_t i=0;i<__threads.size();i++) __threads[i].join();
+    }
+    unsigned long getStolenCount(void) const { return _stolen; }
+    int         getWorkersCount(void) const { return (int)_queues.size(); }
+  protected:
+    struct queue {
+      std::mutex lock;
+      std::deque<size_t> tasks;
+    };
+    std::vector<traceResult>& _results;
+    const options& _options;
+    std::vector<queue> _queues;
+    std::atomic<unsigned long> _stolen{0};
+
+    bool take(size_t worker, size_t& task) {
+      {
+        std::lock_guard<std::mutex> __guard(_queues[worker].lock);
+        if(!_queues[worker].tasks.empty()) {
+          task = _queues[worker].tasks.back();
+          _queues[worker].tasks.pop_back();
+          return true;
+        }
+      }
+      for(size_t i=1;i<_queues.size();i++) {
+        queue& __victim = _queues[(worker + i) % _queues.size()];
+        std::lock_guard<std::mutex> __guard(__victim.lock);
+        if(__victim.tasks.empty()) continue;
+        task = __victim.tasks.front();
+        __victim.tasks.pop_front();
+        _stolen++;
+        return true;
+      }
+      // nothing is added while running - no tasks anywhere means the end
+      return false;
+    }
+    void work(size_t worker) {
+      CSWBatterySim __sim;
+      size_t __task;
+      while(this->take(worker, __task)) analyzeTrace(_results[__task], _options);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////
+// Traces
+////////////////////////////////////////////////////////////////////////
+static bool checkIfDirectory(const std::string& path) {
+  struct stat __st;
+  return (stat(path.c_str(), &__st) == 0) && S_ISDIR(__st.st_mode);
+}
+
+// device is the subdirectory, or the beginning of the file name (till '_' or '.') in the top one
+static void findTraces(const std::string& dir, const std::string& device, std::vector<traceResult>& traces) {
+  DIR * __d = opendir(dir.c_str());
+  if(__d == NULL) return;
+  struct dirent * __entry;
+  while((__entry = readdir(__d)) != NULL) {
+    std::string __name = __entry->d_name;
+    if(__name[0] == '.') continue;
+    std::string __path = dir + "/" + __name;
+    if(checkIfDirectory(__path)) {
+      findTraces(__path, device.empty() ? __name : device, traces);
+      continue;
+    }
+    if((__name.size() < 4) || (__name.compare(__name.size() - 4, 4, ".bin") != 0)) continue;
+    traceResult __r;
+    __r.device = device.empty() ? __name.substr(0, __name.find_first_of("_.")) : device;
+    __r.path = __path;
+    traces.push_back(__r);
+  }
+  closedir(__d);
+}
+
+static bool compareTraces(const traceResult& a, const traceResult& b) {
+  return (a.device != b.device) ? (a.device < b.device) : (a.path < b.path);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Report
+////////////////////////////////////////////////////////////////////////
+// hours from 100% to 0% at the discharge rate of the trace, 0 if it discharged too little to say
+static double getRuntimeHours(const traceResult& r) {
+  if(r.discharged_pct < 10) return 0;
+  return (double)r.discharge_ms / 3600000.0 * 100 / r.discharged_pct;
+}
+
+static void reportDevice(const std::vector<traceResult>& traces, size_t from, size_t to) {
+  traceResult __total;
+  unsigned long __count = 0;
+  // least squares of the runtime over the number of the trace
+  double __n = 0, __sx = 0, __sy = 0, __sxx = 0, __sxy = 0;
+  double __first = 0, __last = 0;
+  for(size_t i=from;i<to;i++) {
+    const traceResult& __r = traces[i];
+    if(!__r.ok) continue;
+    __count++;
+    __total.duration_ms += __r.duration_ms;
+    __total.low_ms += __r.low_ms;
+    __total.low_entries += __r.low_entries;
+    __total.empty_events += __r.empty_events;
+    __total.false_empty += __r.false_empty;
+    double __runtime = getRuntimeHours(__r);
+    if(__runtime <= 0) continue;
+    if(__n == 0) __first = __runtime;
+    __last = __runtime;
+    double __x = i - from;
+    __n++; __sx += __x; __sy += __runtime; __sxx += __x * __x; __sxy += __x * __runtime;
+  }
+  double __fade = 0;
+  if((__n >= 2) && (__n * __sxx - __sx * __sx > 0)) {
+    double __slope = (__n * __sxy - __sx * __sy) / (__n * __sxx - __sx * __sx);
+    __fade = __slope / (__sy / __n) * 100;
+  }
+  printf("{\"device\":\"%s\",\"traces\":%lu,\"failed\":%lu,\"hours\":%.1f,\"low_minutes\":%lu,\"low_entries\":%lu,\"empty_events\":%lu,\"false_empty\":%lu,\"runtime_h\":[%.2f,%.2f],\"fade_pct_per_trace\":%.3f}\n",
+    traces[from].device.c_str(), __count, (unsigned long)(to - from) - __count, __total.duration_ms / 3600000.0, __total.low_ms / 60000,
+    __total.low_entries, __total.empty_events, __total.false_empty, __first, __last, __fade);
+}
+
+int main(int argc, char ** argv) {
+  const char * __dir = NULL;
+  options __options;
+  int __threads = std::thread::hardware_concurrency();
+  for(int i=1;i<argc;i++) {
+    if((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc)) __threads = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--precision") == 0) && (i + 1 < argc)) __options.precision = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--check-times") == 0) && (i + 1 < argc)) __options.check_times = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--low") == 0) && (i + 1 < argc)) __options.low = atoi(argv[++i]);
+    else __dir = argv[i];
+  }
+  if(__dir == NULL) {
+    fprintf(stderr, "Usage: %s dir [--threads N] [--precision N] [--check-times N] [--low N]\n", argv[0]);
+    return 2;
+  }
+  if(__threads < 1) __threads = 1;
+  std::vector<traceResult> __traces;
+  findTraces(__dir, "", __traces);
+  std::sort(__traces.begin(), __traces.end(), compareTraces);
+  if(__traces.empty()) {
+    fprintf(stderr, "No traces in %s.\n", __dir);
+    return 2;
+  }
+  std::chrono::steady_clock::time_point __start = std::chrono::steady_clock::now();
+  workerPool __pool(__traces, __options, min(__threads, (int)__traces.size()));
+  __pool.run();
+  double __s = std::chrono::duration<double>(std::chrono::steady_clock::now() - __start).count();
+  unsigned long __devices = 0;
+  unsigned long __ticks = 0;
+  for(size_t i=0, j=0;i<__traces.size();i=j) {
+    while((j < __traces.size()) && (__traces[j].device == __traces[i].device)) __ticks += __traces[j++].ticks;
+    reportDevice(__traces, i, j);
+    __devices++;
+  }
+  printf("{\"devices\":%lu,\"traces\":%zu,\"threads\":%d,\"ticks\":%lu,\"stolen\":%lu,\"seconds\":%.2f,\"traces_per_s\":%.1f}\n",
+    __devices, __traces.size(), __pool.getWorkersCount(), __ticks, __pool.getStolenCount(), __s, (__s > 0) ? __traces.size() / __s : 0.0);
+  return 0;
+}
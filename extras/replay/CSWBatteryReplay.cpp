@@ -0,0 +1,152 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryReplay.cpp
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Replays the ADC trace recorded by CSWBatteryTraceRecorder through
+  *          CSWBattery on the Linux host and checks the derived events.
+  *
+  *          Build from the root of the library:
+  *          g++ -std=gnu++11 -O2 -Isrc extras/replay/CSWBatteryReplay.cpp $(find src -name '*.cpp') -o cswbattery_replay -pthread
+  *
+  *          cswbattery_replay play trace.bin [expected.txt] [--precision N] [--check-times N]
+  *            without the expectations prints the events ("time_ms event value" per line) -
+  *            the output of the known good run is the expectations file for the next ones;
+  *            with them prints the differences. The summary is the last line (JSON).
+  *            --precision and --check-times are for the traces of version 1 only - the newer
+  *            ones replay with the settings of their header.
+  *          cswbattery_replay record trace.bin [hours]
+  *            records the synthetic discharge on the simulator
+  *
+  ******************************************************************************
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+#include "CSWBattery.h"
+
+static const char * eventNames[] = {"", "percentage", "section", "charging", "empty"};
+
+struct expectations {
+  std::vector<batteryReplayEvent> events;
+  size_t        next=0;
+  unsigned long mismatches=0;
+  unsigned long count=0;
+};
+
+static void printEvent(void * param, const batteryReplayEvent& e) {
+  (void)param;
+  printf("%lu %s %d\n", e.time_ms, eventNames[e.type], e.value);
+}
+
+static void checkEvent(void * param, const batteryReplayEvent& e) {
+  expectations * __x = static_cast<expectations *>(param);
+  __x->count++;
+  if(__x->next < __x->events.size()) {
+    const batteryReplayEvent& __want = __x->events[__x->next++];
+    if((__want.time_ms == e.time_ms) && (__want.type == e.type) && (__want.value == e.value)) return;
+    printf("expected: %lu %s %d, got: %lu %s %d\n", __want.time_ms, eventNames[__want.type], __want.value, e.time_ms, eventNames[e.type], e.value);
+  } else {
+    printf("unexpected: %lu %s %d\n", e.time_ms, eventNames[e.type], e.value);
+  }
+  __x->mismatches++;
+}
+
+static bool readFile(const char * path, std::vector<uint8_t>& data) {
+  FILE * __f = fopen(path, "rb");
+  if(__f == NULL) return false;
+  uint8_t __buf[4096];
+  size_t __n;
+  while((__n = fread(__buf, 1, sizeof(__buf), __f)) > 0) data.insert(data.end(), __buf, __buf + __n);
+  fclose(__f);
+  return true;
+}
+
+static bool readExpectations(const char * path, expectations& x) {
+  FILE * __f = fopen(path, "r");
+  if(__f == NULL) return false;
+  char __name[32];
+  batteryReplayEvent __e;
+  while(fscanf(__f, "%lu %31s %d", &__e.time_ms, __name, &__e.value) == 3) {
+    __e.type = 0;
+    for(int i=1;i<5;i++) if(strcmp(__name, eventNames[i]) == 0) __e.type = i;
+    if(__e.type != 0) x.events.push_back(__e);
+  }
+  fclose(__f);
+  return true;
+}
+
+static int play(int argc, char ** argv) {
+  const char * __trace = NULL;
+  const char * __expected = NULL;
+  int __precision = 1;
+  int __check_times = 5;
+  for(int i=2;i<argc;i++) {
+    if((strcmp(argv[i], "--precision") == 0) && (i + 1 < argc)) __precision = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--check-times") == 0) && (i + 1 < argc)) __check_times = atoi(argv[++i]);
+    else if(__trace == NULL) __trace = argv[i];
+    else __expected = argv[i];
+  }
+  std::vector<uint8_t> __data;
+  if((__trace == NULL) || (!readFile(__trace, __data))) {
+    fprintf(stderr, "Can not read the trace.\n");
+    return 2;
+  }
+  CSWBatteryTraceReader __reader(__data.data(), __data.size());
+  if(!__reader.checkIfValid()) {
+    fprintf(stderr, "Not a CSWBattery trace.\n");
+    return 2;
+  }
+  expectations __x;
+  if((__expected != NULL) && (!readExpectations(__expected, __x))) {
+    fprintf(stderr, "Can not read the expectations.\n");
+    return 2;
+  }
+  CSWBatterySim __sim;
+  CSWBattery __battery(34, __precision);
+  __battery.setBatteryCheckTimes(__check_times);
+  CSWBatteryTraceReplay __replay(__battery, __reader);
+  std::chrono::steady_clock::time_point __start = std::chrono::steady_clock::now();
+  unsigned long __ticks = (__expected != NULL) ? __replay.run(checkEvent, &__x) : __replay.run(printEvent, NULL);
+  double __s = std::chrono::duration<double>(std::chrono::steady_clock::now() - __start).count();
+  if(__x.next < __x.events.size()) __x.mismatches += __x.events.size() - __x.next;
+  printf("{\"ticks\":%lu,\"samples\":%lu,\"skipped\":%lu,\"missing\":%lu,\"mismatches\":%lu,\"samples_per_s\":%.0f}\n",
+    __ticks, __replay.getSamplesCount(), __replay.getSkippedCount(), __replay.getMissingCount(), __x.mismatches,
+    (__s > 0) ? __replay.getSamplesCount() / __s : 0.0);
+  return (__x.mismatches > 0) ? 1 : 0;
+}
+
+static int record(int argc, char ** argv) {
+  if(argc < 3) return 2;
+  unsigned long __hours = (argc > 3) ? strtoul(argv[3], NULL, 10) : 8;
+  CSWBatterySim __sim;
+  // 4.2V -> 3.6V, 12 bits, battery coefficient 1.1
+  CSWBatterySimAdcScript __script;
+  __script.addRamp(__hours * 3600 * 1000, 2370, 2030, 4);
+  __sim.setAdcSource(CSWBatterySimAdcScript::source, &__script);
+  std::vector<uint8_t> __buf(64 + __hours * 3600 / CSWBATTERY_TIME_RECHECK_MIN_S * 32);
+  CSWBatteryTraceRecorder __recorder(__buf.data(), __buf.size());
+  {
+    CSWBattery __battery(34, 1);
+    __battery.setTraceRecorder(&__recorder);
+    __battery.setBatteryStatsReceivingType(CSWBattery::averageReceive);
+    __sim.advance(__hours * 3600 * 1000);
+    __battery.stopCollectingData();
+  }
+  FILE * __f = fopen(argv[2], "wb");
+  if(__f == NULL) return 2;
+  fwrite(__recorder.getData(), 1, __recorder.getSize(), __f);
+  fclose(__f);
+  printf("{\"bytes\":%zu,\"dropped\":%u}\n", __recorder.getSize(), __recorder.getDroppedCount());
+  return 0;
+}
+
+int main(int argc, char ** argv) {
+  if((argc >= 3) && (strcmp(argv[1], "play") == 0)) return play(argc, argv);
+  if((argc >= 3) && (strcmp(argv[1], "record") == 0)) return record(argc, argv);
+  fprintf(stderr, "Usage: %s play trace.bin [expected.txt] [--precision N] [--check-times N]\n       %s record trace.bin [hours]\n", argv[0], argv[0]);
+  return 2;
+}
@@ -11,84 +11,68 @@
 #define uS_TO_S_FACTOR 1000000ULL
 #define mS_TO_S_FACTOR 1000
 
-#include <Arduino.h>
 #include "CSWBattery.h"
+#include "CSWBatteryHAL.h"
 typedef void (*VoidFunctionWithNoParameters) (void);
 
-CSWBattery::CSWBattery(int battery_pin, int precision) {
-  if(DEBUG && (DEBUG_LEVEL >=1) && Serial) {
-    Serial.println("[CSWBattery] Initializing battery.");
-  }
-  if(DEBUG && (DEBUG_LEVEL >=10) && Serial) {
-    Serial.print("[CSWBattery] Battery params: ");
-    Serial.print("  - battery pin: ");
-    Serial.println(battery_pin);
-    Serial.print("  - precision: ");
-    Serial.println(precision);
+static uint32_t CSWBattery_crc32(const uint8_t * data, size_t len) {
+  uint32_t __crc = 0xFFFFFFFF;
+  for(size_t i=0;i<len;i++) {
+    __crc ^= data[i];
+    for(int b=0;b<8;b++) __crc = (__crc >> 1) ^ (0xEDB88320 & (0 - (__crc & 1)));
   }
+  return ~__crc;
+}
+
+CSWBattery::CSWBattery(int battery_pin, int precision) : batteryCf(CSWBATTERY_PROFILE::DEFAULT_CF) {
+  CSWB_LOG(1, "Initializing battery.");
+  CSWB_LOG(10, "Battery params: battery pin: %d, precision: %d", battery_pin, precision);
   if(battery_pin != -100) _battery_pin = battery_pin;
   if(precision != -100) _voltage_precision = precision;
+  this->updateMillivoltsScale();
+  // CSWBATTERY_TIME_RECHECK_MAX_S may be set longer than the window allows
+  _time_recheck_max_s = max(min(_time_recheck_max_s, this->getTimeRecheckLimitS()), _time_recheck_min_s);
 }
 
 int CSWBattery::getSectionsNum() {
   return _sections_num;
 }
 void CSWBattery::setSectionsNum(int sections) {
-  if(DEBUG && (DEBUG_LEVEL >=1) && Serial) {
-    Serial.print("[CSWBattery] Setting sections num to: ");
-    Serial.println(sections);
-  }
+  CSWB_LOG(1, "Setting sections num to: %d", sections);
   _sections_num = sections;
 }
 
 void CSWBattery::setBatteryPin(int battery_pin) {
-  if(DEBUG && (DEBUG_LEVEL >=1) && Serial) {
-    Serial.print("[CSWBattery] Setting battery pin to: ");
-    Serial.println(battery_pin);
-  }
+  CSWB_LOG(1, "Setting battery pin to: %d", battery_pin);
   _battery_pin = battery_pin;
 }
 
 int CSWBattery::getBatteryPin() {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting battery pin: ");
-    Serial.println(_battery_pin);
-  }
+  CSWB_LOG(99, "Getting battery pin: %d", _battery_pin);
   return _battery_pin;
 }
 
 int CSWBattery::getVoltagePrecision() {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting voltage precision: ");
-    Serial.println(_voltage_precision);
-  }
+  CSWB_LOG(99, "Getting voltage precision: %d", _voltage_precision);
   return _voltage_precision;
 }
 
 void CSWBattery::setVoltagePrecision(int precision) {
-  if(DEBUG && (DEBUG_LEVEL >=1) && Serial) {
-    Serial.print("[CSWBattery] Setting voltage precision to: ");
-    Serial.println(precision);
-  }
+  CSWB_LOG(1, "Setting voltage precision to: %d", precision);
   _voltage_precision = precision;
+  this->updateTraceConfig();
 }
 
 void CSWBattery::setBatteryCoefficient(float c) {
-  if(DEBUG && (DEBUG_LEVEL >=1) && Serial) {
-    Serial.print("[CSWBattery] Setting battery coefficient to: ");
-    Serial.println(c);
-  }
+  CSWB_LOG(1, "Setting battery coefficient to: %.2f", c);
   batteryCf=c;
+  this->updateMillivoltsScale();
 }
 
 float CSWBattery::getBatteryCoefficient(bool get_default) {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting battery coefficient");
-    Serial.print(get_default ? " (default one)" : "");
-    Serial.print(": ");
-    Serial.println(get_default ? defaultBatteryCf : batteryCf);
-  }
-  return get_default ? defaultBatteryCf : batteryCf;
+  float __cf = get_default ? this->getProfile().default_cf : batteryCf;
+  CSWB_LOG(99, "Getting battery coefficient%s: %.2f", get_default ? " (default one)" : "", __cf);
+  return __cf;
 }
 
 bool CSWBattery::checkBatteryVoltageChanged(int check_type, bool force_instant_check) {
@@ -99,182 +83,136 @@ bool CSWBattery::checkBatteryVoltageChanged(int check_type, bool force_instant_c
     _battery_voltage_changed = false;
     return __rres;
   }
-  bool res = true;
-  int _lbvi;
-  int _bvi;
-  float _lbv;
-  float _bv;
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Checking if battery voltage has changed. Type of check is: ");
-  }
-  // Firstly let's check for charger attached.
-  // It'll be for all checks the "true" result;
-  bool currently_charging = this->checkIfWeAreCharging(true);
+  // One burst decides it - the outliers are rejected inside of it, so there is
+  // no need to re-read the value with the delays to find out if it was a fluke.
+  batteryBurst __burst = this->sampleBurst();
+  if(__burst.millivolts < 0) {
+    CSWB_LOG(99, "Battery can't be read - not changed.");
+    _battery_voltage_changed = false;
+    return false;
+  }
+  // the deviation of a few readings jumps from burst to burst - it is smoothed over the last ones
+  _burst_noise_mv = (_burst_noise_mv < 0) ? __burst.spread_mv : (3 * _burst_noise_mv + __burst.spread_mv + 2) / 4;
+  long __noise_mv = max(__burst.spread_mv, _burst_noise_mv);
+  float __v = this->quantizeMillivolts(__burst.millivolts, _voltage_precision);
+  int __section = this->convertReadingToSection(__v);
+  int __percentage = this->convertReadingToPercentage(__v);
+  // the charger attached or detached is the change for all the checks
+  bool currently_charging = this->checkIfChargingReading(__v);
+  bool __differs;
+  bool __charging_changed;
   switch(check_type) {
     case 1:
-      //sections
-      if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-        Serial.print("sections: ");
-      }
-      _lbvi = _last_battery_voltage_section;
-      _bvi = this->getBatteryVoltageSection(false,false,force_instant_check);
-      if (_lbvi!=_bvi) {
-        for(int i=0;i<_battery_check_times;i++) {
-          _bvi = this->getBatteryVoltageSection(false,false,force_instant_check);
-          if (_lbvi == _bvi) {
-            if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-              Serial.print("Got fluke.");
-            }
-            res = false; //fluke
-          }
-          delay(_battery_check_delay_ms);
-        }
-        if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-          Serial.println(res ? "Changed." : "Not changed.");
-        }
-        _battery_voltage_changed = res;
-        return res;
-      } else {
-        if(
-          (currently_charging && (_lbvi != -1))
-          ||
-          ((!currently_charging) && (_lbvi == -1))) {
-          if(this->checkIfCollectingData()) this->flushCollectingDataBuffer();
-          if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-            Serial.println("Changed.");
-          }
-          _battery_voltage_changed = true;
-          return true;
-        } else {
-          if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-            Serial.println("Not changed.");
-          }
-          _battery_voltage_changed = false;
-          return false;
-        }
-      }
-    break;
+      CSWB_LOG(99, "Checking if battery voltage has changed. Type of check is: sections.");
+      __differs = (_last_battery_voltage_section != __section);
+      __charging_changed = (currently_charging != (_last_battery_voltage_section == -1));
+      break;
     case 2:
-      //percentage
-      if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-        Serial.print("precentage: ");
-      }
-      _lbvi = _last_battery_voltage_percentage;
-      _bvi = this->getBatteryVoltagePercentage(false,false,force_instant_check);
-      if (_lbvi!=_bvi) {
-        for(int i=0;i<_battery_check_times;i++) {
-          _bvi = this->getBatteryVoltagePercentage(false,false,force_instant_check);
-          if (_lbvi == _bvi) {
-            if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-              Serial.print("Got fluke.");
-            }
-            res = false; //fluke
-          }
-          delay(_battery_check_delay_ms);
-        }
-        if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-          Serial.println(res ? "Changed." : "Not changed.");
-        }
-        _battery_voltage_changed = res;
-        return res;
-      } else {
-        if(
-          (currently_charging && (_lbvi != -1))
-          ||
-          ((!currently_charging) && (_lbvi == -1))) {
-          if(this->checkIfCollectingData()) this->flushCollectingDataBuffer();
-          if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-            Serial.println("Changed.");
-          }
-          _battery_voltage_changed = true;
-          return true;
-        } else {
-          if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-            Serial.println("Not changed.");
-          }
-          _battery_voltage_changed = false;
-          return false;
-        }
-      }
-      //return (_last_battery_voltage_percentage!=this->getBatteryVoltagePercentage());
+      CSWB_LOG(99, "Checking if battery voltage has changed. Type of check is: percentage.");
+      __differs = (_last_battery_voltage_percentage != __percentage);
+      __charging_changed = (currently_charging != (_last_battery_voltage_percentage == -1));
+      break;
     case 3:
-      //voltage
     default:
-      if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-        Serial.print("voltage: ");
-      }
-      _lbv = _last_battery_voltage;
-      _bv = this->getBatteryVoltage(false,false,-1,false,false,-1,force_instant_check);
-      if (_lbv!=_bv) {
-        for(int i=0;i<_battery_check_times;i++) {
-          _bv = this->getBatteryVoltage(false,false,-1,false,false,-1,force_instant_check);
-          if (_lbv == _bv) {
-            if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-              Serial.print("Got fluke.");
-            }
-            res = false; //fluke
-          }
-          delay(_battery_check_delay_ms);
-        }
-        if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-          Serial.println(res ? "Changed." : "Not changed.");
-        }
-        _battery_voltage_changed = res;
-        return res;
-      } else {
-        if(
-          (currently_charging && (_lbv < _charging_threshold))
-          ||
-          ((!currently_charging) && (_lbv >= _charging_threshold))) {
-          if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-            Serial.println("Changed.");
-          }
-          if(this->checkIfCollectingData()) this->flushCollectingDataBuffer();
-          _battery_voltage_changed = true;
-          return true;
-        }
-        else {
-          if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-            Serial.println("Not changed.");
-          }
-          _battery_voltage_changed = false;
-          return false;
-        }
-      }
+      CSWB_LOG(99, "Checking if battery voltage has changed. Type of check is: voltage.");
+      __differs = (_last_battery_voltage != __v);
+      // the gauge tells charging by the current, not by the voltage
+      __charging_changed = (currently_charging != ((_backend != NULL) ? (_last_battery_voltage_percentage == -1) : this->checkIfChargingVoltage(_last_battery_voltage)));
+      break;
+  }
+  bool res;
+  if(__differs) {
+    // the change within the noise of the bursts is a fluke; the charger attached or detached never is
+    long __change = (_last_burst_millivolts < 0) ? -1 : labs(__burst.millivolts - _last_burst_millivolts);
+    res = __charging_changed || (__change < 0) || (__change > CSWBATTERY_BURST_FLUKE_MADS * __noise_mv);
+    if(!res) {
+      CSWB_LOG(99, "Got fluke (%ld mV change, %ld mV noise).", __change, __noise_mv);
+      CSWB_STAT(addFluke());
+    }
+  } else {
+    res = __charging_changed;
+    if(res && this->checkIfCollectingData()) this->flushCollectingDataBuffer();
+  }
+  if(res || !__differs) {
+    _last_burst_millivolts = __burst.millivolts;
+    _last_battery_voltage = __v;
+    _last_battery_voltage_section = __section;
+    _last_battery_voltage_percentage = __percentage;
+  }
+  CSWB_LOG(99, "%s", res ? "Changed." : "Not changed.");
+  _battery_voltage_changed = res;
+  return res;
+}
+
+/// @brief Take the burst of readings in one tight loop and reject the outliers
+/// (further than CSWBATTERY_BURST_OUTLIER_MADS median absolute deviations from the median)
+/// @param num_samples number of readings (-1 - the default number of checks), CSWBATTERY_BURST_MAX_SAMPLES at most
+/// @param scale see convertRawToMillivolts
+/// @return average of the inliers, their spread and the confidence: 1 - all the readings agree, towards 0 - the noise or many outliers
+batteryBurst CSWBattery::sampleBurst(int num_samples, uint32_t scale) {
+  batteryBurst __burst;
+  int __n = (num_samples > 0) ? num_samples : _battery_check_times;
+  if(__n < 1) __n = 1;
+  if(__n > CSWBATTERY_BURST_MAX_SAMPLES) __n = CSWBATTERY_BURST_MAX_SAMPLES;
+  if(_backend != NULL) {
+    // the gauge filters the readings itself
+    __burst.millivolts = this->readBackendMillivolts();
+    __burst.confidence = (__burst.millivolts >= 0) ? 1 : 0;
+    __burst.samples = 1;
+    return __burst;
+  }
+  int __raw[CSWBATTERY_BURST_MAX_SAMPLES];
+  for(int i=0;i<__n;i++) {
+    // insertion sort while reading - the median is needed anyway
+    int __v = this->readRaw();
+    int j = i;
+    while((j > 0) && (__raw[j - 1] > __v)) { __raw[j] = __raw[j - 1]; j--; }
+    __raw[j] = __v;
+  }
+  int __median = __raw[__n / 2];
+  int __dev[CSWBATTERY_BURST_MAX_SAMPLES];
+  for(int i=0;i<__n;i++) {
+    int __d = abs(__raw[i] - __median);
+    int j = i;
+    while((j > 0) && (__dev[j - 1] > __d)) { __dev[j] = __dev[j - 1]; j--; }
+    __dev[j] = __d;
+  }
+  int __mad = __dev[__n / 2];
+  int __limit = CSWBATTERY_BURST_OUTLIER_MADS * max(__mad, 1);
+  long __sum = 0;
+  int __inliers = 0;
+  for(int i=0;i<__n;i++) {
+    if(abs(__raw[i] - __median) > __limit) continue;
+    __sum += this->convertRawToMillivolts(__raw[i], scale);
+    __inliers++;
   }
-  _battery_voltage_changed = false;
-  return __null;
+  __burst.samples = __n;
+  __burst.rejected = __n - __inliers;
+  CSWB_STAT(addBurstRejected(__burst.rejected));
+  __burst.millivolts = (__sum + __inliers / 2) / __inliers;
+  __burst.spread_mv = this->convertRawToMillivolts(__mad, scale);
+  __burst.confidence = ((float)__inliers / __n) * CSWBATTERY_BURST_NOISE_MV / (CSWBATTERY_BURST_NOISE_MV + __burst.spread_mv);
+  CSWB_LOG(99, "Burst of %d readings: %ld mV, %d rejected, confidence %.2f.", __n, __burst.millivolts, __burst.rejected, __burst.confidence);
+  return __burst;
 }
 
 //TODO: Obsolete?
 unsigned long CSWBattery::getLastCheckTime() {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting last check time: ");
-    if(_last_check_tm > 0) Serial.println(_last_check_tm); else Serial.println("NULL");
-  }
-  return (_last_check_tm > 0) ? _last_check_tm : __null;
+  CSWB_LOG(99, "Getting last check time: %lu", _last_check_tm);
+  return (_last_check_tm > 0) ? _last_check_tm : 0;
 }
 //TODO: Obsolete?
 void CSWBattery::setLastCheckTime(unsigned long tm) {
-  if(DEBUG && (DEBUG_LEVEL >=10) && Serial) {
-    Serial.print("[CSWBattery] Setting last check time to: ");
-    Serial.println(tm);
-  }
-  _last_check_tm = (tm == 0) ? millis() : tm;
+  CSWB_LOG(10, "Setting last check time to: %lu", tm);
+  _last_check_tm = (tm == 0) ? CSWBatteryHAL::getMillis() : tm;
 }
 
 float CSWBattery::getLastBatteryVoltage() {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting last battery voltage: ");
-    Serial.println(_last_battery_voltage);
-  }
+  CSWB_LOG(99, "Getting last battery voltage: %.2f", _last_battery_voltage);
   return _last_battery_voltage;
 }
 void CSWBattery::setLastBatteryVoltage(float v) {
-  if(DEBUG && (DEBUG_LEVEL >=10) && Serial) {
-    Serial.print("[CSWBattery] Setting battery last voltage to: ");
-    Serial.println(v);
-  }
+  CSWB_LOG(10, "Setting battery last voltage to: %.2f", v);
   _last_battery_voltage = v;
 }
 
@@ -282,213 +220,390 @@ void CSWBattery::setLastBatteryVoltage(float v) {
 /// @param tp (default) - instant; - average;
 void CSWBattery::setBatteryStatsReceivingType(data_receiving_type tp) {
   if(tp == averageReceive) _getAvgData = true; else _getAvgData = false;
+  this->updateTraceConfig();
   if(_getAvgData && (!_collecting_data_started)) this->startCollectingData();
 }
 
 float CSWBattery::getBatteryVoltage(bool no_update, bool get_raw, int override_precision, bool check_thoroughly, bool use_default_cf, int override_num_checks_thoroughly, bool force_instant_value, bool force_average_value) {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.println("[CSWBattery] Getting battery voltage with params: ");
-    if(no_update) Serial.println("- no update;");
-    if(get_raw) {
-      Serial.print("  - get raw data (without coefficient - current value is ");
-      Serial.print(this->getBatteryCoefficient());
-      Serial.println(");");
-    }
-    if(override_precision != -1) {
-      Serial.print("  - override battery precision to: ");
-      Serial.print(override_precision);
-      Serial.println(");");
-    }
-    if(check_thoroughly) {
-      Serial.print("  - check thoroughly (");
-      Serial.print((override_num_checks_thoroughly != -1) ? _battery_check_times : override_num_checks_thoroughly);
-      Serial.print(" times with a delay ");
-      Serial.print(_battery_check_delay_ms);
-      Serial.println(" ms and afterwards get the average value);");
-    }
-    if(use_default_cf) {
-      Serial.print("  - using default coefficient: ");
-      Serial.print(this->getBatteryCoefficient(true));
-      Serial.println(");");
-    }
-    if(override_num_checks_thoroughly != -1) {
-      Serial.print("  - override number of checks for thoroughly checking to: ");
-      Serial.print(override_num_checks_thoroughly);
-      Serial.println(");");
-    }
-  }
-  float __cf = this->getBatteryCoefficient(false);
-  float __cfD = this->getBatteryCoefficient(true);
-  float __last_battery_voltage=0;
-  if(_getAvgData && force_average_value && (battery_checks.size() < batteryChecksMinThreshold)) {
+  CSWB_LOG(99, "Getting battery voltage with params:%s%s%s%s",
+    no_update ? " no update;" : "",
+    get_raw ? " get raw data (without coefficient);" : "",
+    check_thoroughly ? " check thoroughly;" : "",
+    use_default_cf ? " using default coefficient;" : "");
+  if(override_precision != -1) CSWB_LOG(99, "  - override battery precision to: %d", override_precision);
+  if(override_num_checks_thoroughly != -1) CSWB_LOG(99, "  - override number of checks for thoroughly checking to: %d", override_num_checks_thoroughly);
+  if(_getAvgData && force_average_value && (!this->checkIfAverageReady())) {
     return -100;
   }
-  if((_getAvgData) && (
-    (!force_instant_value)
-    &&
-    (override_precision == -1) // we have collected data with just one precision only.
-    &&
-    (battery_checks.size() >= batteryChecksMinThreshold) // can't return average data without sufficient amount of... data
-    &&
-    (__cf != 0) //if that was broken
-  )) {
-    if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-      Serial.println("[CSWBattery] Processing average data.");
-      Serial.print("[CSWBattery] Size of stack: ");
-      Serial.println(battery_checks.size());
+  if(_getAvgData && (!force_instant_value)) {
+    if(!this->checkIfAverageReady()) {
+      CSWB_LOG(99, "Due to lack of collected data we'll override check_thoroughly value to true and just collect the current data - thoroughly.");
+      check_thoroughly = true;
     }
-    float __res = -1;
-    float __cf = this->getBatteryCoefficient(use_default_cf);
-    float sum_of_elems=0;
-    for (auto& __bc : battery_checks) sum_of_elems += __bc.voltage;
-    __res = sum_of_elems / battery_checks.size();
-    __res = (_voltage_precision >= 2) ? 
-      round(__res * pow(10.0,_voltage_precision)) / pow(10.0,_voltage_precision)
-      :
-      ( (_voltage_precision == 1) ? round(__res * 10.0) / 10.0 : floor(__res) );
-    if(use_default_cf && (!get_raw)) __res = __res * __cfD /__cf;
-    if(__res < 0) __res = -1;
-    __last_battery_voltage = __res;
-    if(get_raw && (__res >=0)) __res = __res / __cf; //default CF in here doesn't make sense as the data was collected using non-default one
-    else if(get_raw) __res = -1;
-    if(!no_update) _last_battery_voltage = __last_battery_voltage;
-    return __res;
-  }
-  if((_getAvgData) && (battery_checks.size() < batteryChecksMinThreshold) && (!force_instant_value)) {
-    if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-      Serial.println("[CSWBattery] Due to lack of collected data we'll override check_thoroughly value to true");
-      Serial.println("[CSWBattery] and just collect the current data - thoroughly.");
-    }
-    check_thoroughly = true;
+    else if((override_precision == -1) && (this->getBatteryCoefficient(false) != 0)) return this->readAverageVoltage(get_raw, use_default_cf, no_update); // we have collected data with just one precision only
   }
+  int __num_checks = check_thoroughly ? ((override_num_checks_thoroughly == -1) ? _battery_check_times : override_num_checks_thoroughly) : 0;
+  return this->readInstantVoltage(override_precision, __num_checks, get_raw, use_default_cf, no_update);
+}
+
+/// @brief Voltage from the collected data
+float CSWBattery::readAverageVoltage(bool get_raw, bool use_default_cf, bool no_update) {
+  CSWB_LOG(99, "Processing average data. Size of stack: %d", battery_checks.size());
+  float __cf = this->getBatteryCoefficient(use_default_cf);
+  long __mv = this->getCollectedMillivolts();
+  if(use_default_cf && (!get_raw)) __mv = lround(__mv * this->getProfile().default_cf / batteryCf);
+  float __res = this->quantizeMillivolts(__mv, _voltage_precision);
+  if(!no_update) _last_battery_voltage = __res;
+  if(get_raw && (__res >= 0)) __res = this->quantizeMillivolts(lround(__mv / __cf), _voltage_precision); //default CF in here doesn't make sense as the data was collected using non-default one
+  return __res;
+}
+
+/// @brief Millivolts of the collected data: the filter's value, or the plain average of the window without the filter
+long CSWBattery::getCollectedMillivolts(void) {
+  return (_battery_filter != NULL) ? _battery_filter->getValue() : battery_checks.getAverageMillivolts();
+}
+
+/// @brief Voltage read from the pin right now
+/// @param num_checks number of the readings with the delays; 0 - one reading without the delay
+float CSWBattery::readInstantVoltage(int override_precision, int num_checks, bool get_raw, bool use_default_cf, bool no_update) {
   int __voltage_precision = (override_precision != -1) ? override_precision : _voltage_precision;
-  float __batteryCf = this->getBatteryCoefficient(use_default_cf);
-  if(check_thoroughly) {
-    int __battery_check_times = (override_num_checks_thoroughly == -1) ? _battery_check_times : override_num_checks_thoroughly;
-    for(int i=0;i<__battery_check_times;i++) {
-      int _battery_pin_current_value = analogRead(_battery_pin);
-      __last_battery_voltage += (__voltage_precision >= 2) ?
-        round(((float)(_battery_pin_current_value) / 4095*2*3.3*(get_raw ? 1 : __batteryCf))* pow(10.0,__voltage_precision)) / pow(10.0,__voltage_precision)
-        :
-        (
-          (__voltage_precision == 1) ?
-          round(((float)(_battery_pin_current_value) / 4095*2*3.3*(get_raw ? 1 : __batteryCf))* 10.0) / 10.0
-          :
-          floor(((float)(_battery_pin_current_value) / 4095*2*3.3*(get_raw ? 1 : batteryCf)))
-        );
-        delay(_battery_check_delay_ms);
+  // 0 means the table built for the current coefficient
+  uint32_t __scale = get_raw ? this->getMillivoltsScale(1) : (use_default_cf ? this->getMillivoltsScale(this->getProfile().default_cf) : 0);
+  float __res = this->quantizeMillivolts(this->sampleMillivolts(max(num_checks, 1), __scale, num_checks > 0), __voltage_precision);
+  if(!no_update) _last_battery_voltage = __res;
+  return __res;
+}
+
+/// @brief Round the voltage the way all the readings are rounded
+/// @param v voltage
+/// @param precision number of digits after the point; 0 - just floor it
+float CSWBattery::roundVoltage(float v, int precision) {
+  return this->quantizeMillivolts(lround(v * 1000), precision);
+}
+
+/// @brief Turn millivolts into the volts which are returned to the user
+/// @param mv millivolts
+/// @param precision number of digits after the point (3 at most); 0 - just floor it
+float CSWBattery::quantizeMillivolts(long mv, int precision) {
+  if(mv < 0) return -1;
+  if(precision >= 3) return mv / 1000.0f;
+  if(precision == 2) return ((mv + 5) / 10) / 100.0f;
+  if(precision == 1) return ((mv + 50) / 100) / 10.0f;
+  return (float)(mv / 1000);
+}
+
+/// @brief Fixed point (16.16) factor which turns the ADC reading into millivolts
+/// @param cf battery coefficient
+uint32_t CSWBattery::getMillivoltsScale(float cf) {
+  return CSWBatteryProfileOf<CSWBATTERY_PROFILE>::getMillivoltsScale(cf);
+}
+
+/// @brief Called every time the battery coefficient changes
+void CSWBattery::updateMillivoltsScale(void) {
+  _millivolts_scale = this->getMillivoltsScale(batteryCf);
+  CSWB_LOG(10, "Millivolts scale set. Full scale is: %d mV.", this->convertRawToMillivolts((1L << this->getProfile().adc_bits) - 1));
+}
+
+int CSWBattery::convertRawToMillivolts(int raw, uint32_t scale) {
+  return this->convertRawToMillivoltsOf<CSWBATTERY_PROFILE>(raw, scale);
+}
+
+/// @brief Convert the single ADC reading of the battery pin to volts
+/// @param raw value returned by analogRead
+/// @param cf battery coefficient to apply (1 for the raw value)
+/// @param precision see quantizeMillivolts
+float CSWBattery::convertRawToVoltage(int raw, float cf, int precision) {
+  return this->quantizeMillivolts(this->convertRawToMillivolts(raw, this->getMillivoltsScale(cf)), precision);
+}
+
+/// @brief Read the battery pin and average the readings. Nothing is rounded in here
+/// @param num_checks number of readings
+/// @param scale see convertRawToMillivolts
+/// @param with_delays wait _battery_check_delay_ms after each reading
+/// @return average millivolts of the readings which succeeded; -1 if none did (the gauge doesn't answer)
+long CSWBattery::sampleMillivolts(int num_checks, uint32_t scale, bool with_delays) {
+  if((_backend != NULL) && _backend->checkIfFiltered()) return this->readBackendMillivolts();
+  if(num_checks < 1) num_checks = 1;
+  long __sum = 0;
+  int __done = 0;
+  for(int i=0;i<num_checks;i++) {
+    long __mv = (_backend != NULL) ? this->readBackendMillivolts() : this->convertRawToMillivolts(this->readRaw(), scale);
+    if(__mv >= 0) {
+      __sum += __mv;
+      __done++;
     }
-    __last_battery_voltage = __last_battery_voltage/__battery_check_times;
-    __last_battery_voltage = (__voltage_precision >= 2) ? round(__last_battery_voltage * pow(10.0,__voltage_precision)) / pow(10.0,__voltage_precision)
-        :
-        (
-          (__voltage_precision == 1) ?
-          round(__last_battery_voltage * 10.0) / 10.0
-          :
-          floor(__last_battery_voltage)
-        );
-  } else {
-    int _battery_pin_current_value = analogRead(_battery_pin);
-    __last_battery_voltage = (__voltage_precision >= 2) ?
-      round(((float)(_battery_pin_current_value) / 4095*2*3.3*(get_raw ? 1 : __batteryCf))* pow(10.0,__voltage_precision)) / pow(10.0,__voltage_precision)
-      :
-      (
-        (__voltage_precision == 1) ?
-        round(((float)(_battery_pin_current_value) / 4095*2*3.3*(get_raw ? 1 : __batteryCf))* 10.0) / 10.0
-        :
-        floor(((float)(_battery_pin_current_value) / 4095*2*3.3*(get_raw ? 1 : __batteryCf)))
-      );
+    if(with_delays) this->waitMs(_battery_check_delay_ms);
   }
-  if(!no_update) _last_battery_voltage = __last_battery_voltage;
-  return __last_battery_voltage;
+  if(__done == 0) return -1;
+  return (__sum + __done / 2) / __done;
 }
 
-int CSWBattery::getBatteryVoltageSection(bool no_update, bool check_thoroughly, bool force_instant_check) {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting battery voltage section with params: ");
-    Serial.println(no_update ? "  - without update;" : "");
-    Serial.println(check_thoroughly ? " - check thoroughly;" : "");
+int CSWBattery::readRaw(void) {
+  CSWB_STAT(addAnalogReads(1));
+  int __raw = CSWBatteryHAL::readAnalog(_battery_pin);
+  if(_trace_recorder != NULL) _trace_recorder->addSample(CSWBatteryHAL::getMillis(), __raw);
+  return __raw;
+}
+
+/// @brief Read the gauge. The percentage and charging of the reading are kept for the conversions
+/// @return millivolts or -1 if the gauge doesn't answer (the last good reading is kept then)
+long CSWBattery::readBackendMillivolts(void) {
+  CSWB_STAT(addAnalogReads(1));
+  batteryReading __r;
+  if((!_backend->read(__r)) || (__r.millivolts < 0)) {
+    CSWB_LOG(10, "Can't read the battery backend.");
+    CSWB_STAT(addReadFailure());
+    return -1;
   }
-  float v = this->getBatteryVoltage(false, false, -1, check_thoroughly,false,-1,force_instant_check);
-  int voltage_section = -1;
-  if (v >= _charging_threshold) voltage_section = -1; else {
-    voltage_section = ceil((min(v,_fully_charged_voltage)-_fully_uncharged_voltage) * _sections_num/(_fully_charged_voltage-_fully_uncharged_voltage));
+  this->publishBackendReading(__r);
+  return __r.millivolts;
+}
+
+/// @brief Keep the reading for the conversions. The gauge may be read by the sampling task and
+/// the user at once - the one which comes second skips it, both readings are of the same moment
+void CSWBattery::publishBackendReading(const batteryReading& r) {
+  if(_backend_writing.test_and_set(std::memory_order_acquire)) return;
+  _backend_reading.write(r);
+  _backend_writing.clear(std::memory_order_release);
+}
+
+void CSWBattery::waitMs(unsigned long ms) {
+  CSWB_STAT(addDelay(ms));
+  CSWBatteryHAL::delayMs(ms);
+}
+
+void CSWBattery::callHandler(VoidFunctionWithNoParameters f) {
+  if(f == NULL) return;
+#if CSWBATTERY_STATS
+  unsigned long __start_us = CSWBatteryHAL::getMicros();
+  f();
+  _stats.addHandler(CSWBatteryHAL::getMicros() - __start_us);
+#else
+  f();
+#endif
+}
+
+/// @brief Counters of the battery handling since the start (or resetStats()).
+/// All zeros if the library is built with CSWBATTERY_STATS=0
+batteryStats CSWBattery::getStats(void) {
+#if CSWBATTERY_STATS
+  return _stats.get();
+#else
+  batteryStats __s;
+  return __s;
+#endif
+}
+
+void CSWBattery::resetStats(void) {
+  CSWB_STAT(reset());
+}
+
+/// @brief Start the non-blocking thorough measurement. The samples are taken by pollMeasurement()
+/// @param num_checks number of samples to take (-1 means the default number of checks)
+/// @param use_default_cf use the default battery coefficient instead of the calibrated one
+/// @return false if another measurement is still in progress
+bool CSWBattery::startMeasurement(int num_checks, bool use_default_cf) {
+  if(this->checkIfCalibrating()) {
+    CSWB_LOG(10, "Can't start the measurement - the battery is being calibrated.");
+    return false;
+  }
+  return this->startMeasurementScaled(num_checks, use_default_cf ? this->getMillivoltsScale(this->getBatteryCoefficient(true)) : 0, _voltage_precision, true);
+}
+
+bool CSWBattery::startMeasurementScaled(int num_checks, uint32_t scale, int precision, bool update_last) {
+  if(_measurement_state == measurementInProgress) {
+    CSWB_LOG(10, "Can't start the measurement - the previous one is still in progress.");
+    return false;
+  }
+  _measurement_num_checks = (num_checks > 0) ? num_checks : _battery_check_times;
+  CSWB_LOG(99, "Starting the measurement of %d samples.", _measurement_num_checks);
+  _measurement_checks_done = 0;
+  _measurement_samples = 0;
+  _measurement_sum = 0;
+  _measurement_scale = scale;
+  _measurement_precision = precision;
+  _measurement_update_last = update_last;
+  _measurement_voltage = -1;
+  _measurement_state = measurementInProgress;
+  return true;
+}
+
+/// @brief Advance the measurement. Takes at most one sample and never waits
+/// @return state of the measurement after the poll
+CSWBattery::measurement_state CSWBattery::pollMeasurement(void) {
+  if(_measurement_state != measurementInProgress) return _measurement_state;
+  unsigned long __current_time = CSWBatteryHAL::getMillis();
+  if((_measurement_checks_done > 0) && (__current_time - _measurement_last_sample_tm < (unsigned long)_battery_check_delay_ms)) {
+    return _measurement_state;
   }
+  // one reading of the gauge is the whole measurement
+  bool __whole = (_backend != NULL) && _backend->checkIfFiltered();
+  long __mv = (_backend != NULL) ? this->readBackendMillivolts() : this->convertRawToMillivolts(this->readRaw(), _measurement_scale);
+  if(__mv >= 0) {
+    _measurement_sum += __mv;
+    _measurement_samples++;
+  }
+  _measurement_checks_done = __whole ? _measurement_num_checks : (_measurement_checks_done + 1);
+  _measurement_last_sample_tm = __current_time;
+  if(_measurement_checks_done < _measurement_num_checks) return _measurement_state;
+  // -1 if nothing was read
+  _measurement_voltage = (_measurement_samples > 0) ? this->quantizeMillivolts((_measurement_sum + _measurement_samples / 2) / _measurement_samples, _measurement_precision) : -1;
+  if(_measurement_update_last) _last_battery_voltage = _measurement_voltage;
+  _measurement_state = measurementDone;
+  CSWB_LOG(99, "Measurement done: %.2fV.", _measurement_voltage);
+  if(_measurement_update_last) this->callHandler(measurementDoneHandler);
+  return _measurement_state;
+}
+
+CSWBattery::measurement_state CSWBattery::getMeasurementState(void) {
+  return _measurement_state;
+}
+
+bool CSWBattery::checkIfMeasurementReady(void) {
+  return _measurement_state == measurementDone;
+}
+
+/// @brief Get the result of the finished measurement
+/// @return voltage or -1 if the measurement is not done yet
+float CSWBattery::getMeasuredBatteryVoltage(void) {
+  return (_measurement_state == measurementDone) ? _measurement_voltage : -1;
+}
+
+/// @brief Cancel the measurement in progress. pollMeasurement() reports measurementCancelled then;
+/// if it was the measurement of the calibration, the calibration is cancelled too
+void CSWBattery::cancelMeasurement(void) {
+  if(_measurement_state == measurementInProgress) _measurement_state = measurementCancelled;
+}
+
+int CSWBattery::getBatteryVoltageSection(bool no_update, bool check_thoroughly, bool force_instant_check) {
+  CSWB_LOG(99, "Getting battery voltage section with params:%s%s", no_update ? " without update;" : "", check_thoroughly ? " check thoroughly;" : "");
+  float v = this->getBatteryVoltage(false, false, -1, check_thoroughly,false,-1,force_instant_check);
+  int voltage_section = this->convertReadingToSection(v);
   if(!no_update) _last_battery_voltage_section = voltage_section;
   return voltage_section;
 }
 
 int CSWBattery::getBatteryVoltagePercentage(bool no_update, bool check_thoroughly, bool force_instant_value) {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting battery voltage percentage with params: ");
-    Serial.println(no_update ? "  - without update;" : "");
-    Serial.println(check_thoroughly ? " - check thoroughly;" : "");
-  }
+  CSWB_LOG(99, "Getting battery voltage percentage with params:%s%s", no_update ? " without update;" : "", check_thoroughly ? " check thoroughly;" : "");
   float v = this->getBatteryVoltage(false, false, -1, check_thoroughly,false,-1,force_instant_value);
-  int voltage_p = -1;
-  if (v >= _charging_threshold) voltage_p = -1; else {
-    voltage_p = round((min(v,_fully_charged_voltage)-_fully_uncharged_voltage)*100/(_fully_charged_voltage-_fully_uncharged_voltage));
-  }
+  int voltage_p = this->convertReadingToPercentage(v);
   if(!no_update) _last_battery_voltage_percentage = voltage_p;
   return voltage_p;
 }
 
-void CSWBattery::setLastBatteryVoltageSection(int s) {
-  if(DEBUG && (DEBUG_LEVEL >=10) && Serial) {
-    Serial.print("[CSWBattery] Setting last battery voltage section to: ");
-    Serial.println(s);
+/// @brief Map the voltage to the section of the battery icon by the discharge curve
+/// @return section number or -1 if we are charging
+int CSWBattery::convertVoltageToSection(float v) {
+  if (this->checkIfChargingVoltage(v)) return -1;
+  long __p = this->getPercentageX100(v);
+  return (__p * _sections_num + 9999) / 10000;
+}
+
+/// @brief Map the voltage to the battery level by the discharge curve
+/// @return percentage or -1 if we are charging
+int CSWBattery::convertVoltageToPercentage(float v) {
+  if (this->checkIfChargingVoltage(v)) return -1;
+  return (this->getPercentageX100(v) + 50) / 100;
+}
+
+long CSWBattery::getPercentageX100(float v) {
+  return this->getPercentageX100Of<CSWBATTERY_PROFILE>(v);
+}
+
+long CSWBattery::getReadingPercentageX100(float v) {
+  if(_backend != NULL) {
+    long __p = _backend_reading.read().percentage_x100;
+    if(__p >= 0) return __p;
+  }
+  return this->getPercentageX100(v);
+}
+
+/// @brief With the gauge its charge current decides (if the gauge measures it)
+bool CSWBattery::checkIfChargingReading(float v) {
+  if(_backend != NULL) {
+    int __charging = _backend_reading.read().charging;
+    if(__charging >= 0) return __charging == 1;
+  }
+  return this->checkIfChargingVoltage(v);
+}
+
+int CSWBattery::convertReadingToPercentage(float v) {
+  if (this->checkIfChargingReading(v)) return -1;
+  return (this->getReadingPercentageX100(v) + 50) / 100;
+}
+
+int CSWBattery::convertReadingToSection(float v) {
+  if (this->checkIfChargingReading(v)) return -1;
+  long __p = this->getReadingPercentageX100(v);
+  return (__p * _sections_num + 9999) / 10000;
+}
+
+/// @brief Set the discharge curve used for the percentage and sections
+/// @param points curve points (voltages of one cell, taken as they are) sorted by the voltage; the array is not copied
+/// @param num_points number of points (2 at least)
+void CSWBattery::setDischargeCurve(const batteryCurvePoint * points, int num_points) {
+  if((points == NULL) || (num_points < 2)) {
+    CSWB_LOG(1, "Can't set the discharge curve with %d points.", num_points);
+    return;
   }
+  CSWB_LOG(1, "Setting discharge curve of %d points.", num_points);
+  _discharge_curve = CSWBatteryCurve(points, num_points);
+  _default_curve = false;
+}
+
+/// @brief Back to the default curve - stretched over the empty - full range of the profile
+void CSWBattery::resetDischargeCurve(void) {
+  CSWB_LOG(1, "Resetting discharge curve to the default one.");
+  _discharge_curve = CSWBatteryCurve();
+  _default_curve = true;
+}
+
+const CSWBatteryCurve& CSWBattery::getDischargeCurve(void) {
+  return _discharge_curve;
+}
+
+/// @brief Voltage of the pack at 0%: the empty voltage of the profile with the default curve,
+/// otherwise the first point of the curve
+long CSWBattery::getEmptyMillivolts(void) {
+  if(_default_curve) return lround(this->getProfile().empty_v * 1000);
+  return _discharge_curve.getEmptyMillivolts() * this->getProfile().cells;
+}
+
+void CSWBattery::setLastBatteryVoltageSection(int s) {
+  CSWB_LOG(10, "Setting last battery voltage section to: %d", s);
   _last_battery_voltage_section = s;
 }
 
 int CSWBattery::getLastBatteryVoltageSection() {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting battery last voltage section: ");
-    Serial.println(_last_battery_voltage_section);
-  }
+  CSWB_LOG(99, "Getting battery last voltage section: %d", _last_battery_voltage_section);
   return _last_battery_voltage_section;
 }
 
 void CSWBattery::setLastBatteryVoltagePercentage(int s) {
-  if(DEBUG && (DEBUG_LEVEL >=10) && Serial) {
-    Serial.print("[CSWBattery] Setting last battery voltage percentage time to: ");
-    Serial.println(s);
-  }
+  CSWB_LOG(10, "Setting last battery voltage percentage to: %d", s);
   _last_battery_voltage_percentage = s;
 }
 
 int CSWBattery::getLastBatteryVoltagePercentage() {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting battery last voltage percentage: ");
-    Serial.println(_last_battery_voltage_percentage);
-  }
+  CSWB_LOG(99, "Getting battery last voltage percentage: %d", _last_battery_voltage_percentage);
   return _last_battery_voltage_percentage;
 }
 
 bool CSWBattery::checkIfWeAreCharging(bool force_instant_check) {
   bool res = (_getAvgData && (!force_instant_check)) ?
-    (this->getLastBatteryVoltage() >= _charging_threshold)
+    this->checkIfChargingReading(this->getLastBatteryVoltage())
      :
-    (this->getBatteryVoltage(false,false,-1,false,false,-1,force_instant_check) >= _charging_threshold);
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Checking if we are charging: ");
-    Serial.println(res ? "yes." : "no.");
-  }
+    this->checkIfChargingReading(this->readBatteryVoltage<READ_INSTANT>());
+  CSWB_LOG(99, "Checking if we are charging: %s", res ? "yes." : "no.");
   return res;
 }
 
 void CSWBattery::setBatteryIsCalibrated(bool cs) {
-  if(DEBUG && (DEBUG_LEVEL >=10) && Serial) {
-    Serial.print("[CSWBattery] Setting battery calibration to: ");
-    Serial.println(cs ? "calibrated." : "not calibrated.");
-  }
+  CSWB_LOG(10, "Setting battery calibration to: %s", cs ? "calibrated." : "not calibrated.");
   _calibrationStatus = cs;
 }
 bool CSWBattery::getBatteryIsCalibrated() {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Checking if battery is calibrated: ");
-    Serial.println(_calibrationStatus ? "yes." : "no.");
-  }
+  CSWB_LOG(99, "Checking if battery is calibrated: %s", _calibrationStatus ? "yes." : "no.");
   return _calibrationStatus;
 }
 
@@ -510,87 +625,207 @@ bool CSWBattery::checkIfEmpty() {
   float __v;
   bool res = false;
   if(_getAvgData) {
-    __v = this->getBatteryVoltage(false, false, -1, true, false, -1, false, true);
+    __v = this->readBatteryVoltage<READ_THOROUGH | READ_AVERAGE>();
     if(__v == -100) {
-      if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-        Serial.println("[CSWBattery] Checking if battery is empty: ...");
-        Serial.println("[CSWBattery] No sufficient amount of data was captured so saying 'no'.");
-      }
+      CSWB_LOG(99, "Checking if battery is empty: no sufficient amount of data was captured so saying 'no'.");
       return false; // we want average data to be really sure if it's not a fluke
     } // (__v == -100)
   } else { //!_getAvgData
-    __v = this->getBatteryVoltage(false, false, -1, true);
-    res = ((__v <= _fully_uncharged_voltage) && (__v >=0));
-    if(res) { //res && !_getAvgData => check just once more - just in case, with a small delay
-      delay(_battery_recheck_empty_delay_ms);
-      __v = this->getBatteryVoltage(false, false, -1, true);
+    __v = this->readBatteryVoltage<READ_THOROUGH>();
+    res = this->checkIfEmptyVoltage(__v);
+    if(res && ((_backend == NULL) || (!_backend->checkIfFiltered()))) { //res && !_getAvgData => check just once more - just in case, with a small delay
+      this->waitMs(_battery_recheck_empty_delay_ms);
+      __v = this->readBatteryVoltage<READ_THOROUGH>();
     }
   }
-  res = ((__v <= _fully_uncharged_voltage) && (__v >=0));
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Checking if battery is empty: ");
-    Serial.println(res ? "yes." : "no.");
-    Serial.print("[CSWBattery] Voltage captured: ");
-    Serial.print(__v);
-    Serial.println("V.");
-  }
+  res = this->checkIfEmptyVoltage(__v);
+  CSWB_LOG(99, "Checking if battery is empty: %s Voltage captured: %.2fV.", res ? "yes." : "no.", __v);
   return res;
 }
 
+bool CSWBattery::checkIfEmptyVoltage(float v) {
+  return this->checkIfEmptyVoltageOf<CSWBATTERY_PROFILE>(v);
+}
+
+bool CSWBattery::checkIfChargingVoltage(float v) {
+  return this->checkIfChargingVoltageOf<CSWBATTERY_PROFILE>(v);
+}
+
 void CSWBattery::resetBattery() {
-  if(DEBUG && (DEBUG_LEVEL >=1) && Serial) {
-    Serial.print("[CSWBattery] Resetting battery coefficient. New value is: ");
-    Serial.println(defaultBatteryCf);
-  }
-  batteryCf = defaultBatteryCf;
+  CSWB_LOG(1, "Resetting battery coefficient. New value is: %.2f", this->getProfile().default_cf);
+  batteryCf = this->getProfile().default_cf;
+  this->updateMillivoltsScale();
   this->setBatteryIsCalibrated(false);
 }
 
 void CSWBattery::stopCalibration(void) {
   _stop_calibration = true;
+  if(this->checkIfCalibrating()) {
+    CSWB_LOG(1, "Calibration cancelled.");
+    // the measurement was the one of the calibration - nothing to report to the user
+    _measurement_state = measurementIdle;
+    this->setCalibrationState(calibrationCancelled);
+  }
 }
 
+/// @brief Calibrate the battery and wait until it is done. Has to be started on the charger,
+/// the calibration is finished when the charger is unplugged. See startCalibration()
+/// for the version which does not block.
 void CSWBattery::calibrateBattery(int precision) {
-  if(DEBUG && (DEBUG_LEVEL >=1) && Serial) {
-    Serial.print("[CSWBattery] Calibrating battery. Current coefficient value is: ");
-    Serial.println(this->getBatteryCoefficient());
+  if(!this->startCalibration(precision)) return;
+  while(this->checkIfCalibrating()) {
+    this->pollCalibration();
+    this->waitMs(CALIBRATION_POLL_DELAY_MS);
   }
+}
+
+/// @brief Start the calibration in the background. Has to be started on the charger,
+/// then pollCalibration() has to be called from the loop until the charger is unplugged.
+/// @param precision precision of the voltage measured after the unplug
+/// @return false if the calibration is already running or the ADC is busy with the measurement
+bool CSWBattery::startCalibration(int precision) {
+  if(this->checkIfCalibrating()) return false;
+  if(_backend != NULL) {
+    CSWB_LOG(1, "Can't calibrate - the battery is measured by the gauge.");
+    return false;
+  }
+  CSWB_LOG(1, "Calibrating battery. Current coefficient value is: %.2f", batteryCf);
   _stop_calibration = false;
-  float batteryV1=getBatteryVoltage(true, false, -1, true, true, -1, true);
-  float batteryV2=batteryV1;
-  // we olny care about the difference between the values - the first
-  // value (on charger) is none of our interest
-  while (abs(batteryV1 - batteryV2) <= batteryVCalibrationDiffThreshold) {
-    //waiting for the unplug of the charger
-    batteryV2 = getBatteryVoltage(true, false, -1, true, true, -1, true);
-    delay(100);
-    if(_stop_calibration) return;
-  }
-  // because when the board is unplugged the battery voltage can go
-  // dramatically down and then back to normal
-  delay(batteryCalibrationDelayMS);
-  //now batteryV2 HAS to be equal to _fully_charged_voltage;
-  batteryV1 = getBatteryVoltage(true, true, precision, true, false, _calibrationIterations, true);
-  batteryCf = _fully_charged_voltage / batteryV1;
-  if(DEBUG && (DEBUG_LEVEL >=1) && Serial) {
-    Serial.print("[CSWBattery] New coefficient value is: ");
-    Serial.println(this->getBatteryCoefficient());
-  }
-  this->setBatteryIsCalibrated(true);
+  _calibration_precision = precision;
+  // reference value (on the charger) - we olny care about the difference with it
+  if(!this->startMeasurementScaled(-1, this->getMillivoltsScale(this->getProfile().default_cf), _voltage_precision, false)) return false;
+  this->setCalibrationState(calibrationReference);
+  return true;
 }
 
-void CSWBattery::setCalibrationIterations(int c) {
-  if(DEBUG && (DEBUG_LEVEL >=1) && Serial) {
-    Serial.print("[CSWBattery] Setting battery calibration interations to: ");
-    Serial.println(c);
+/// @brief Advance the calibration. Never waits
+/// @return state of the calibration after the poll
+CSWBattery::calibration_state CSWBattery::pollCalibration(void) {
+  if(!this->checkIfCalibrating()) return _calibration_state;
+  if(_stop_calibration) {
+    this->stopCalibration();
+    return _calibration_state;
   }
+  // cancelMeasurement() in the middle of the calibration - the calibration can't go on without it
+  if(_measurement_state == measurementCancelled) {
+    CSWB_LOG(1, "Calibration cancelled - its measurement was cancelled.");
+    _measurement_state = measurementIdle;
+    this->setCalibrationState(calibrationCancelled);
+    return _calibration_state;
+  }
+  unsigned long __current_time = CSWBatteryHAL::getMillis();
+  switch(_calibration_state) {
+    case calibrationReference:
+      if(this->pollMeasurement() != measurementDone) break;
+      _calibration_reference_v = _measurement_voltage;
+      _measurement_state = measurementIdle;
+      _calibration_next_tm = __current_time;
+      this->setCalibrationState(calibrationWaitingForUnplug);
+      break;
+    case calibrationWaitingForUnplug:
+      if(_measurement_state == measurementIdle) {
+        if((long)(__current_time - _calibration_next_tm) < 0) break;
+        this->startMeasurementScaled(-1, this->getMillivoltsScale(this->getProfile().default_cf), _voltage_precision, false);
+      }
+      if(this->pollMeasurement() != measurementDone) break;
+      _measurement_state = measurementIdle;
+      if(fabs(_calibration_reference_v - _measurement_voltage) <= batteryVCalibrationDiffThreshold) {
+        _calibration_next_tm = __current_time + CALIBRATION_UNPLUG_CHECK_MS;
+        break;
+      }
+      // because when the board is unplugged the battery voltage can go
+      // dramatically down and then back to normal
+      _calibration_next_tm = __current_time + batteryCalibrationDelayMS;
+      this->setCalibrationState(calibrationSettling);
+      break;
+    case calibrationSettling:
+      if((long)(__current_time - _calibration_next_tm) < 0) break;
+      this->startMeasurementScaled(_calibrationIterations, this->getMillivoltsScale(1), _calibration_precision, false);
+      this->setCalibrationState(calibrationMeasuring);
+      break;
+    case calibrationMeasuring:
+      if(this->pollMeasurement() != measurementDone) break;
+      _measurement_state = measurementIdle;
+      if(_measurement_voltage <= 0) {
+        CSWB_LOG(1, "Calibration failed - no voltage measured.");
+        this->setCalibrationState(calibrationCancelled);
+        break;
+      }
+      //now the battery HAS to be fully charged;
+      batteryCf = this->getProfile().full_v / _measurement_voltage;
+      this->updateMillivoltsScale();
+      CSWB_LOG(1, "New coefficient value is: %.2f", batteryCf);
+      this->setBatteryIsCalibrated(true);
+      if(_calibration_storage != NULL) this->saveCalibration();
+      this->setCalibrationState(calibrationDone);
+      break;
+    default:
+      break;
+  }
+  return _calibration_state;
+}
+
+void CSWBattery::setCalibrationState(calibration_state st) {
+  _calibration_state = st;
+  this->callHandler(calibrationProgressHandler);
+  if((st == calibrationDone) || (st == calibrationCancelled)) this->callHandler(calibrationDoneHandler);
+}
+
+CSWBattery::calibration_state CSWBattery::getCalibrationState(void) {
+  return _calibration_state;
+}
+
+bool CSWBattery::checkIfCalibrating(void) {
+  return (_calibration_state != calibrationIdle) && (_calibration_state != calibrationDone) && (_calibration_state != calibrationCancelled);
+}
+
+/// @brief Where the calibration results are saved to and loaded from
+/// @param storage storage backend; NULL - do not persist the calibration
+/// @param key name of the record
+void CSWBattery::setCalibrationStorage(CSWBatteryStorage * storage, const char * key) {
+  _calibration_storage = storage;
+  _calibration_storage_key = key;
+}
+
+/// @brief Save the current coefficient to the calibration storage
+bool CSWBattery::saveCalibration(void) {
+  if(_calibration_storage == NULL) return false;
+  batteryCalibrationRecord __record;
+  memset(&__record, 0, sizeof(__record));
+  __record.magic = CALIBRATION_RECORD_MAGIC;
+  __record.version = CALIBRATION_RECORD_VERSION;
+  __record.size = sizeof(__record);
+  __record.battery_cf = batteryCf;
+  __record.calibrated = _calibrationStatus ? 1 : 0;
+  __record.crc = CSWBattery_crc32((const uint8_t *)&__record, offsetof(batteryCalibrationRecord, crc));
+  bool __res = _calibration_storage->write(_calibration_storage_key, &__record, sizeof(__record));
+  CSWB_LOG(1, "Saving calibration: %s", __res ? "done." : "failed.");
+  return __res;
+}
+
+/// @brief Load the coefficient from the calibration storage, so the battery does not have to be recalibrated on every start
+/// @return false if there is no valid record - the coefficient is not changed then
+bool CSWBattery::loadCalibration(void) {
+  if(_calibration_storage == NULL) return false;
+  batteryCalibrationRecord __record;
+  size_t __read = _calibration_storage->read(_calibration_storage_key, &__record, sizeof(__record));
+  if((__read != sizeof(__record)) || (__record.magic != CALIBRATION_RECORD_MAGIC) || (__record.version != CALIBRATION_RECORD_VERSION)
+    || (__record.size != sizeof(__record)) || (__record.battery_cf <= 0)
+    || (__record.crc != CSWBattery_crc32((const uint8_t *)&__record, offsetof(batteryCalibrationRecord, crc)))) {
+    CSWB_LOG(1, "No valid calibration record found.");
+    return false;
+  }
+  this->setBatteryCoefficient(__record.battery_cf);
+  this->setBatteryIsCalibrated(__record.calibrated != 0);
+  return true;
+}
+
+void CSWBattery::setCalibrationIterations(int c) {
+  CSWB_LOG(1, "Setting battery calibration interations to: %d", c);
   _calibrationIterations = c;
 }
 int CSWBattery::getCalibrationIterations() {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting calibration iterations: ");
-    Serial.println(_calibrationIterations);
-  }
+  CSWB_LOG(99, "Getting calibration iterations: %d", _calibrationIterations);
   return _calibrationIterations;
 }
 
@@ -601,124 +836,480 @@ int CSWBattery::getBatteryCheckType(void) {
   return _check_type;
 }
 
+/// @brief Collect the battery data. Only one burst of samples is taken per tick -
+/// the voltage, percentage, section, charging, change and empty statuses are all derived from it.
 void CSWBattery::tick(void) {
-  batteryCheck __firstElem;
-  unsigned long __current_time = millis();
-  if(battery_checks.size() > 0) {
-    __firstElem = battery_checks.front();
-    if(__current_time -  __firstElem.time_checked < _time_recheck_s*mS_TO_S_FACTOR) return;
+  unsigned long __current_time = CSWBatteryHAL::getMillis();
+#if CSWBATTERY_STATS
+  unsigned long __start_us = CSWBatteryHAL::getMicros();
+#endif
+  bool __refresh = _refresh_requested.exchange(false);
+  if((battery_checks.size() > 0) && (!__refresh)) {
+    if(__current_time - battery_checks.front().time_checked < _time_recheck_s*mS_TO_S_FACTOR) return;
   }
+  if(_trace_recorder != NULL) _trace_recorder->addMarker(__current_time, CSWBatteryTraceRecorder::MARKER_TICK);
+  int __last_percentage = _last_battery_voltage_percentage;
+  long __last_millivolts = (battery_checks.size() > 0) ? battery_checks.back().millivolts : -1;
   batteryCheck __batCheck;
   __batCheck.time_checked = __current_time;
-  __batCheck.percentage = this->getBatteryVoltagePercentage(false, true, true);
-  __batCheck.section = this->getBatteryVoltageSection(false, true, true);
-  __batCheck.voltage = this->getLastBatteryVoltage();
-  __firstElem = (battery_checks.size() > 0) ? battery_checks.front() : __batCheck;
-  battery_checks.push_back(__batCheck);
-  // FIFO
-  while((battery_checks.size() > 0) && (__current_time - __firstElem.time_checked > _time_limit_s*mS_TO_S_FACTOR)) {
+  __batCheck.millivolts = this->sampleMillivolts(_battery_check_times, 0, true);
+  if(__batCheck.millivolts < 0) {
+    // nothing was read - the collected data, the filter, the estimator and the history stay as they are
+    CSWB_LOG(10, "Tick skipped - the battery can't be read.");
+    CSWB_STAT(addSkippedTick());
+    return;
+  }
+  __batCheck.voltage = this->quantizeMillivolts(__batCheck.millivolts, _voltage_precision);
+  _last_battery_voltage = __batCheck.voltage;
+  __batCheck.percentage = this->convertReadingToPercentage(__batCheck.voltage);
+  __batCheck.section = this->convertReadingToSection(__batCheck.voltage);
+  _last_battery_voltage_percentage = __batCheck.percentage;
+  _last_battery_voltage_section = __batCheck.section;
+  this->setLastCheckTime(__current_time);
+  // the refresh right after the tick only updates the last values - the buffer is sized
+  // for the checks _time_recheck_min_s apart, more of them would push out the ones of the window
+  bool __too_soon = __refresh && (battery_checks.size() > 0) && (__current_time - battery_checks.back().time_checked < _time_recheck_min_s*mS_TO_S_FACTOR);
+  if(!__too_soon) {
+    // FIFO - the ring buffer drops the oldest check by itself when it is full
+    battery_checks.push_back(__batCheck);
+    if(_battery_filter != NULL) _battery_filter->update(__batCheck.millivolts);
+  }
+  while((battery_checks.size() > 0) && (__current_time - battery_checks.front().time_checked > _time_limit_s*mS_TO_S_FACTOR)) {
     battery_checks.pop_front();
-    if(battery_checks.size() > 0) __firstElem = battery_checks.front(); else break;
   }
   bool __last_charging_status = _last_charging_status;
-  _last_charging_status = this->checkIfWeAreCharging(true);
+  _last_charging_status = this->checkIfChargingReading(__batCheck.voltage);
+  if(_battery_history != NULL) _battery_history->add(__current_time, __batCheck.millivolts, __batCheck.percentage, _last_charging_status);
   bool __chargingStatusChanged = (__last_charging_status != _last_charging_status);
+  // the trend of the charge has nothing to do with the trend of the discharge
+  if(__chargingStatusChanged) _estimator.reset();
+  _estimator.update(__current_time, __batCheck.millivolts);
   if (__chargingStatusChanged) {
-    if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-      Serial.println("[CSWBattery] Flushing buffer and setting voltage status as changed because the charging status has changed.");
-    }
+    CSWB_LOG(99, "Flushing buffer and setting voltage status as changed because the charging status has changed.");
     this->flushCollectingDataBuffer();
-    _battery_voltage_changed=true;
   }
-  bool bvChanged = this->checkBatteryVoltageChanged(2,true);
-  if (__chargingStatusChanged || bvChanged) {
-    if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-      Serial.println("[CSWBattery] Setting to True the voltage changed status.");
-    }
-    _battery_voltage_changed=true;
+  // the burst is already averaged, so there is no need to re-read it for flukes
+  bool bvChanged = (__last_percentage != __batCheck.percentage);
+  _battery_voltage_changed = (__chargingStatusChanged || bvChanged);
+  if(_battery_voltage_changed && (changeBatteryLevelHandler != NULL)) {
+    CSWB_LOG(99, "Calling changeBatteryLevelHandler!");
+    this->callHandler(changeBatteryLevelHandler);
   }
-  if(_battery_voltage_changed && (changeBatteryLevelHandler != NULL)) { //this->checkBatteryVoltageChanged()
-    if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-      Serial.println("[CSWBattery] Calling changeBatteryLevelHandler!");
-    }
-    changeBatteryLevelHandler();
+  bool __empty = this->checkIfEmptyCollectedData(__batCheck.voltage);
+  if(_adaptive_sampling) this->adaptTimeRecheck(__last_millivolts, __batCheck.millivolts, __batCheck.percentage, __chargingStatusChanged);
+  this->publishSnapshot(__empty, __current_time);
+  if(__refresh && (_refresh_waiters.load() > 0)) _refresh_done.give();
+  if(__empty && (emptyBatteryHandler != NULL)) {
+    CSWB_LOG(99, "Calling emptyBatteryHandler!");
+    this->callHandler(emptyBatteryHandler);
   }
-  if(this->checkIfEmpty() && (emptyBatteryHandler != NULL)) {
-    if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-      Serial.println("[CSWBattery] Calling emptyBatteryHandler!");
-    }
-    emptyBatteryHandler();
+  CSWB_STAT(setOccupancy(battery_checks.size()));
+  CSWB_STAT(addTick(CSWBatteryHAL::getMicros() - __start_us));
+
+  CSWB_LOG(99, "Tick lasted %lu ms.", CSWBatteryHAL::getMillis() - __current_time);
+}
+
+/// @brief Same as checkIfEmpty() but without reading the ADC: the average of the
+/// collected data if we collect it, otherwise the given voltage
+bool CSWBattery::checkIfEmptyCollectedData(float v) {
+  if(!_getAvgData) return this->checkIfEmptyVoltage(v);
+  if(!this->checkIfAverageReady()) return false;
+  return this->checkIfEmptyVoltage(this->quantizeMillivolts(this->getCollectedMillivolts(), _voltage_precision));
+}
+
+/// @brief Publish what the getters return: the collected (filtered) data if we collect it, otherwise the last tick
+void CSWBattery::publishSnapshot(bool empty, unsigned long tm) {
+  BatterySnapshot __snapshot;
+  __snapshot.voltage = _last_battery_voltage;
+  __snapshot.percentage = _last_battery_voltage_percentage;
+  __snapshot.section = _last_battery_voltage_section;
+  if(_getAvgData && this->checkIfAverageReady()) {
+    __snapshot.voltage = this->quantizeMillivolts(this->getCollectedMillivolts(), _voltage_precision);
+    __snapshot.percentage = this->convertReadingToPercentage(__snapshot.voltage);
+    __snapshot.section = this->convertReadingToSection(__snapshot.voltage);
+  }
+  __snapshot.charging = _last_charging_status;
+  __snapshot.low = (__snapshot.percentage != -1) && (__snapshot.percentage <= low_battery_threshold_percent);
+  __snapshot.empty = empty;
+  __snapshot.timestamp = (tm == 0) ? 1 : tm;
+  __snapshot.sample_count = battery_checks.size();
+  if(_last_charging_status) __snapshot.minutes_to_full = _estimator.getMinutesTo(this->getChargedMillivolts());
+  else __snapshot.minutes_to_empty = _estimator.getMinutesTo(this->getEmptyMillivolts());
+  __snapshot.estimate_confidence = _estimator.getConfidence();
+  _snapshot.write(__snapshot);
+}
+
+/// @brief Get the state published by the last tick. Never reads the ADC and never locks,
+/// so it is safe to call from any task on any core
+/// @return the snapshot; timestamp is 0 if no tick has happened yet
+BatterySnapshot CSWBattery::getBatterySnapshot(void) {
+  return _snapshot.read();
+}
+
+bool CSWBattery::checkIfSnapshotAvailable(void) {
+  return _snapshot.getSequence() > 2; // the first write is the empty snapshot of the constructor
+}
+
+/// @brief Save the collected data, last values, charging status and coefficient
+/// into the blob which survives the deep sleep (RTC_DATA_ATTR memory)
+/// @param buf where to save - RTC_STATE_SIZE bytes at least
+/// @param len size of buf
+/// @return number of bytes written, 0 if buf is too small
+size_t CSWBattery::saveState(void * buf, size_t len) {
+  if((buf == NULL) || (len < sizeof(batteryRtcState))) {
+    CSWB_LOG(1, "Can't save the state - %u bytes are needed.", (unsigned)sizeof(batteryRtcState));
+    return 0;
+  }
+  unsigned long __current_time = CSWBatteryHAL::getMillis();
+  batteryRtcState __state;
+  memset(&__state, 0, sizeof(__state));
+  __state.magic = RTC_STATE_MAGIC;
+  __state.version = RTC_STATE_VERSION;
+  __state.flags = (_last_charging_status ? 1 : 0) | (_calibrationStatus ? 2 : 0);
+  __state.battery_cf = batteryCf;
+  __state.last_voltage = _last_battery_voltage;
+  __state.last_percentage = _last_battery_voltage_percentage;
+  __state.last_section = _last_battery_voltage_section;
+  __state.time_recheck_s = _time_recheck_s;
+  for(int i=0;i<battery_checks.size();i++) {
+    unsigned long __age = (__current_time - battery_checks[i].time_checked) / 100;
+    if(__age > 0xFFFF) continue; // way too old anyway
+    __state.checks[__state.count].age_ds = __age;
+    __state.checks[__state.count].millivolts = battery_checks[i].millivolts;
+    __state.count++;
   }
+  __state.crc = CSWBattery_crc32((const uint8_t *)&__state, offsetof(batteryRtcState, crc));
+  memcpy(buf, &__state, sizeof(__state));
+  CSWB_LOG(10, "State saved with %d checks.", __state.count);
+  return sizeof(__state);
+}
 
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    unsigned long __current_time_end = millis();
-    Serial.print("[CSWBattery] Tick lasted ");
-    Serial.print(__current_time_end-__current_time);
-    Serial.println(" ms.");
+/// @brief Restore the state saved by saveState(), so after the wake up the collected
+/// data is available at once
+/// @param buf saved blob
+/// @param len size of buf
+/// @param slept_ms how long we were sleeping - the age of the saved checks is increased by it
+/// @return false if the blob is broken or of the other version - nothing is restored then
+bool CSWBattery::restoreState(const void * buf, size_t len, unsigned long slept_ms) {
+  if((buf == NULL) || (len < sizeof(batteryRtcState))) return false;
+  batteryRtcState __state;
+  memcpy(&__state, buf, sizeof(__state));
+  if((__state.magic != RTC_STATE_MAGIC) || (__state.version != RTC_STATE_VERSION) || (__state.count > CSWBATTERY_CHECKS_CAPACITY)
+    || (__state.crc != CSWBattery_crc32((const uint8_t *)&__state, offsetof(batteryRtcState, crc)))) {
+    CSWB_LOG(1, "Saved state is broken - not restoring it.");
+    return false;
+  }
+  unsigned long __current_time = CSWBatteryHAL::getMillis();
+  if(__state.battery_cf != batteryCf) this->setBatteryCoefficient(__state.battery_cf);
+  _calibrationStatus = (__state.flags & 2);
+  _last_charging_status = (__state.flags & 1);
+  _last_battery_voltage = __state.last_voltage;
+  _last_battery_voltage_percentage = __state.last_percentage;
+  _last_battery_voltage_section = __state.last_section;
+  _time_recheck_s = min(max((unsigned long)__state.time_recheck_s, _time_recheck_min_s), _time_recheck_max_s);
+  battery_checks.clear();
+  _estimator.reset();
+  for(int i=0;i<__state.count;i++) {
+    unsigned long __age = __state.checks[i].age_ds * 100UL + slept_ms;
+    if(__age > _time_limit_s*mS_TO_S_FACTOR) continue;
+    batteryCheck __batCheck;
+    // millis() restarted after the sleep - the unsigned arithmetic of tick() deals with the "negative" time
+    __batCheck.time_checked = __current_time - __age;
+    __batCheck.millivolts = __state.checks[i].millivolts;
+    __batCheck.voltage = this->quantizeMillivolts(__batCheck.millivolts, _voltage_precision);
+    // the same conversions as tick() - otherwise the first tick would see the level change
+    __batCheck.percentage = this->convertReadingToPercentage(__batCheck.voltage);
+    __batCheck.section = this->convertReadingToSection(__batCheck.voltage);
+    battery_checks.push_back(__batCheck);
+    _estimator.update(__batCheck.time_checked, __batCheck.millivolts);
   }
+  if(_battery_filter != NULL) this->setBatteryFilter(_battery_filter);
+  CSWB_LOG(10, "State restored with %d of %d checks.", battery_checks.size(), __state.count);
+  this->publishSnapshot(this->checkIfEmptyCollectedData(_last_battery_voltage), __current_time);
+  return true;
 }
+
+/// @brief Start the sampling task. Does nothing if it is running already;
+/// if the battery was added to the CSWBatteryManager its task does the sampling instead
 void CSWBattery::startCollectingData(void) {
-  if(DEBUG && (DEBUG_LEVEL >=1) && Serial) Serial.println("[CSWBattery] Starting collecting data.");
-  _collecting_data_started = true;
-  xTaskCreate(
+  CSWB_LOG(1, "Starting collecting data.");
+  bool __was_started = _collecting_data_started.exchange(true);
+  if(_manager != NULL) {
+    _manager->reschedule();
+    return;
+  }
+  void * __task = _tick_task.load();
+  // called by the sampling task itself (e.g. from the handler) - it just goes on
+  if((__task != NULL) && (__task == CSWBatteryHAL::getCurrentTask())) return;
+  if(__was_started && (__task != NULL)) return;
+  // the task may still be on its way out after stopCollectingData()
+  this->waitForTickTaskExit();
+  __task = CSWBatteryHAL::createTask(
     CSWBattery_tick,    // Function that should be called
     "CSWBattery Tick",   // Name of the task (for debugging)
-    4096,            // Stack size (bytes)
+    CSWBATTERY_TASK_STACK_SIZE, // Stack size (bytes)
     this,            // Parameter to pass
-    1,               // Task priority
-    NULL             // Task handle
+    1                // Task priority
   );
+  // the task waits for its handle to be stored - otherwise it could exit first and its NULL would be overwritten
+  _tick_task.store(__task);
+  if(__task != NULL) _tick_task_ready.give();
 }
 
+/// @brief Stop the sampling right away - the sleeping task is woken up to exit.
+/// When called from the other task, returns after the last tick is over
 void CSWBattery::stopCollectingData(void) {
+  CSWB_LOG(1, "Stopping collecting data.");
   _collecting_data_started = false;
+  if(_manager != NULL) {
+    _manager->reschedule();
+    return;
+  }
+  void * __task = _tick_task.load();
+  if((__task == NULL) || (__task == CSWBatteryHAL::getCurrentTask())) return;
+  CSWBatteryHAL::notifyTask(__task, NOTIFY_STOP);
+  this->waitForTickTaskExit();
+}
+
+/// @brief Wake the sampling task (or the manager) up for the tick right now, e.g. when the screen is woken up.
+/// No ADC reading is done by the caller. From the handler inside of the sampling task the
+/// tick is only marked - the task does it right after the current one, so it can't be waited for
+/// @param timeout_ms 0 - do not wait; otherwise wait for the fresh snapshot this long at most
+/// @return false if the data is not collected or the fresh snapshot did not come in time
+bool CSWBattery::requestRefresh(unsigned long timeout_ms) {
+  if(!this->checkIfCollectingData()) return false;
+  CSWB_LOG(99, "Refresh requested.");
+  void * __task = _tick_task.load();
+  if((_manager == NULL) && (__task != NULL) && (__task == CSWBatteryHAL::getCurrentTask())) {
+    _refresh_requested = true;
+    return timeout_ms == 0;
+  }
+  uint32_t __sequence = _snapshot.getSequence();
+  if(timeout_ms > 0) _refresh_waiters++;
+  _refresh_requested = true;
+  if(_manager != NULL) {
+    _manager->reschedule();
+  } else if(__task != NULL) {
+    CSWBatteryHAL::notifyTask(__task, NOTIFY_REFRESH);
+  }
+  if(timeout_ms == 0) return true;
+  unsigned long __start = CSWBatteryHAL::getMillis();
+  bool __fresh;
+  for(;;) {
+    __fresh = (_snapshot.getSequence() != __sequence) && (!_refresh_requested.load());
+    unsigned long __elapsed = CSWBatteryHAL::getMillis() - __start;
+    if(__fresh || (__elapsed >= timeout_ms)) break;
+    _refresh_done.take(timeout_ms - __elapsed);
+  }
+  // the signal wakes one waiter at a time - pass it on
+  if((--_refresh_waiters > 0) && __fresh) _refresh_done.give();
+  return __fresh;
+}
+
+void CSWBattery::waitForTickTaskExit(void) {
+  while(_tick_task.load() != NULL) CSWBatteryHAL::delayMs(1);
 }
 
 bool CSWBattery::checkIfCollectingData(void) {
   return _collecting_data_started;
 }
 void CSWBattery::flushCollectingDataBuffer(void) {
+  CSWB_STAT(addFlush());
   battery_checks.clear();
+  if(_battery_filter != NULL) _battery_filter->reset();
 }
 
-void CSWBattery::setDebugLevel(int d) {
-  if(DEBUG && Serial) {
-    Serial.print("[CSWBattery] Setting debug level to: ");
-    Serial.println(d);
+/// @brief Filter the collected data with the given filter instead of the plain average of the window
+/// @param f filter (e.g. CSWBatteryEwmaFilter<>, CSWBatteryKalmanFilter, CSWBatteryMedianFilter<5>); NULL - the plain average
+void CSWBattery::setBatteryFilter(CSWBatteryFilter * f) {
+  CSWB_LOG(1, "Setting battery filter: %s", (f != NULL) ? "custom." : "window average.");
+  _battery_filter = f;
+  if(_battery_filter == NULL) return;
+  // let the filter start with what we have already collected
+  _battery_filter->reset();
+  for(int i=0;i<battery_checks.size();i++) _battery_filter->update(battery_checks[i].millivolts);
+}
+
+CSWBatteryFilter * CSWBattery::getBatteryFilter(void) {
+  return _battery_filter;
+}
+
+/// @brief Keep the long-term history of the ticks (for the battery graphs) in the given store
+/// @param h history, it has to live as long as the battery does; NULL - no history
+void CSWBattery::setBatteryHistory(CSWBatteryHistory * h) {
+  CSWB_LOG(1, "Setting battery history: %s", (h != NULL) ? "on." : "off.");
+  _battery_history = h;
+}
+
+CSWBatteryHistory * CSWBattery::getBatteryHistory(void) {
+  return _battery_history;
+}
+
+/// @brief Record every ADC reading (and the start of every tick) into the recorder's buffer,
+/// so the behaviour seen in the field can be replayed on the host (CSWBatteryTraceReplay).
+/// The recording starts over with the current battery coefficient; the header also keeps
+/// the way the data is read (see CSWBatteryTraceRecorder::setConfig())
+/// @param r recorder, it has to live as long as the battery does; NULL - stop recording
+void CSWBattery::setTraceRecorder(CSWBatteryTraceRecorder * r) {
+  CSWB_LOG(1, "Setting trace recorder: %s", (r != NULL) ? "on." : "off.");
+  if(r != NULL) r->begin(CSWBatteryHAL::getMillis(), batteryCf);
+  _trace_recorder = r;
+  this->updateTraceConfig();
+}
+
+void CSWBattery::updateTraceConfig(void) {
+  if(_trace_recorder == NULL) return;
+  _trace_recorder->setConfig(_getAvgData ? CSWBatteryTraceRecorder::FLAG_AVERAGED : 0, _battery_check_times, _voltage_precision);
+}
+
+CSWBatteryTraceRecorder * CSWBattery::getTraceRecorder(void) {
+  return _trace_recorder;
+}
+
+/// @brief Measure the battery with the fuel gauge (CSWBatteryBackend.h) instead of the ADC
+/// of the battery pin. The getters, handlers and the sampling task stay the same; the
+/// percentage and sections are the state of charge of the gauge, and its charge current
+/// tells if we are charging (convertVoltageToPercentage() and the like still use the discharge
+/// curve). No calibration is needed (or possible) with the gauge
+/// @param b backend, it has to live as long as the battery does; NULL - back to the ADC
+/// @return false if the backend doesn't answer (the ADC stays in use then)
+bool CSWBattery::setBatteryBackend(CSWBatteryBackend * b) {
+  if((b != NULL) && (!b->begin())) {
+    CSWB_LOG(1, "Battery backend doesn't answer.");
+    return false;
   }
+  CSWB_LOG(1, "Setting battery backend: %s", (b != NULL) ? "custom." : "ADC.");
+  this->publishBackendReading(batteryReading());
+  _backend = b;
+  return true;
+}
+
+CSWBatteryBackend * CSWBattery::getBatteryBackend(void) {
+  return _backend;
+}
+
+/// @brief Estimated time till the battery is empty, from the trend of the ticks
+/// @return minutes; -1 if charging or the voltage does not go down
+long CSWBattery::getMinutesToEmpty(void) {
+  return _snapshot.read().minutes_to_empty;
+}
+
+/// @brief Estimated time till the charge is over, from the trend of the ticks (see setChargedVoltage())
+/// @return minutes; -1 if discharging or the voltage does not go up
+long CSWBattery::getMinutesToFull(void) {
+  return _snapshot.read().minutes_to_full;
+}
+
+/// @brief How much the estimates can be trusted: 0 - not at all, 1 - the voltage follows the straight line
+float CSWBattery::getEstimateConfidence(void) {
+  return _snapshot.read().estimate_confidence;
+}
+
+/// @brief Voltage of the pack when the charge is over - the target of the time to full estimate.
+/// The 100% point of the profile is used by default; 0 or less - back to it
+void CSWBattery::setChargedVoltage(float v) {
+  CSWB_LOG(1, "Setting charged voltage to: %.3f", v);
+  _charged_millivolts = (v > 0) ? lround(v * 1000) : -1;
+}
+
+long CSWBattery::getChargedMillivolts(void) {
+  return (_charged_millivolts > 0) ? _charged_millivolts : lround(this->getProfile().full_v * 1000);
+}
+
+/// @brief Number of the readings of one thorough check. With the filter fewer readings are usually enough
+void CSWBattery::setBatteryCheckTimes(int c) {
+  CSWB_LOG(1, "Setting battery check times to: %d", c);
+  if(c >= 1) _battery_check_times = c;
+  this->updateTraceConfig();
+}
+
+int CSWBattery::getBatteryCheckTimes(void) {
+  return _battery_check_times;
+}
+
+void CSWBattery::setDebugLevel(int d) {
+  CSWB_LOG(0, "Setting debug level to: %d", d);
   if(d >= -1) DEBUG_LEVEL = d;
 }
 
 int CSWBattery::getDebugLevel(void) {
-  if(DEBUG && (DEBUG_LEVEL >=99) && Serial) {
-    Serial.print("[CSWBattery] Getting debug level: ");
-    Serial.println(DEBUG_LEVEL);
-  }
+  CSWB_LOG(99, "Getting debug level: %d", DEBUG_LEVEL);
   return DEBUG_LEVEL;
 }
 void CSWBattery::setDebug(bool d) {
-  if(DEBUG && Serial) {
-    Serial.print("[CSWBattery] Setting debug to: ");
-    Serial.println(d ? "on." : "off");
-  }
+  CSWB_LOG(0, "Setting debug to: %s", d ? "on." : "off.");
   DEBUG = d;
+  if(DEBUG) CSWBatteryLog::startDrainTask();
 }
 void CSWBattery::enableDebug(void) {
-  if(DEBUG && Serial) {
-    Serial.print("[CSWBattery] Setting debug to: on.");
-  }
+  CSWB_LOG(0, "Setting debug to: on.");
   DEBUG = true;
+  CSWBatteryLog::startDrainTask();
 }
 void CSWBattery::disableDebug(void) {
-  if(DEBUG && Serial) {
-    Serial.print("[CSWBattery] Setting debug to: off.");
-  }
+  CSWB_LOG(0, "Setting debug to: off.");
   DEBUG = false;
 }
+/// @brief Current interval between the ticks. It is changed by the adaptive sampling
 unsigned long CSWBattery::getTimeRecheckS(void) {
   return _time_recheck_s;
 }
 
+/// @brief Let the interval between the ticks follow the battery: it grows by the step while
+/// the voltage is stable and falls to the minimum while charging, under the heavy load or
+/// when the battery is close to the low threshold
+void CSWBattery::setAdaptiveSampling(bool a) {
+  CSWB_LOG(1, "Setting adaptive sampling to: %s", a ? "on." : "off.");
+  _adaptive_sampling = a;
+  if(!a) _time_recheck_s = CSWBATTERY_TIME_RECHECK_S;
+}
+
+bool CSWBattery::getAdaptiveSampling(void) {
+  return _adaptive_sampling;
+}
+
+/// @brief Configure the adaptive sampling
+/// @param min_s shortest interval; can't be below CSWBATTERY_TIME_RECHECK_MIN_S as the data buffer is sized for it
+/// @param max_s longest interval; can't be above the time limit / batteryChecksMinThreshold, otherwise
+/// the window would not keep enough checks for the average
+/// @param step_s how much the interval grows after each stable tick
+void CSWBattery::setTimeRecheckLimits(unsigned long min_s, unsigned long max_s, unsigned long step_s) {
+  unsigned long __min_t = CSWBATTERY_TIME_RECHECK_MIN_S;
+  unsigned long __max_t = max(this->getTimeRecheckLimitS(), __min_t);
+  _time_recheck_min_s = min(max(min_s, __min_t), __max_t);
+  _time_recheck_max_s = min(max(max_s, _time_recheck_min_s), __max_t);
+  _time_recheck_step_s = step_s;
+  CSWB_LOG(1, "Setting recheck limits to: %lu-%lu s, step %lu s.", _time_recheck_min_s, _time_recheck_max_s, _time_recheck_step_s);
+  if(_time_recheck_s < _time_recheck_min_s) _time_recheck_s = _time_recheck_min_s;
+  if(_time_recheck_s > _time_recheck_max_s) _time_recheck_s = _time_recheck_max_s;
+}
+
+unsigned long CSWBattery::getTimeRecheckMinS(void) {
+  return _time_recheck_min_s;
+}
+unsigned long CSWBattery::getTimeRecheckMaxS(void) {
+  return _time_recheck_max_s;
+}
+unsigned long CSWBattery::getTimeRecheckStepS(void) {
+  return _time_recheck_step_s;
+}
+
+/// @brief Longest interval which still leaves batteryChecksMinThreshold checks in the window
+unsigned long CSWBattery::getTimeRecheckLimitS(void) {
+  return _time_limit_s / batteryChecksMinThreshold;
+}
+
+void CSWBattery::adaptTimeRecheck(long last_mv, long mv, int percentage, bool charging_status_changed) {
+  long __change = (last_mv < 0) ? 0 : labs(mv - last_mv);
+  bool __near_low = (percentage != -1) && (percentage <= low_battery_threshold_percent + CSWBATTERY_ADAPTIVE_LOW_MARGIN);
+  if(_last_charging_status || charging_status_changed || __near_low || (__change >= CSWBATTERY_ADAPTIVE_FAST_CHANGE_MV)) {
+    _time_recheck_s = _time_recheck_min_s;
+  } else if(__change <= CSWBATTERY_ADAPTIVE_STABLE_CHANGE_MV) {
+    _time_recheck_s = min(_time_recheck_s + _time_recheck_step_s, _time_recheck_max_s);
+  }
+  CSWB_LOG(99, "Voltage changed by %ld mV, next check in %lu s.", __change, _time_recheck_s);
+}
+
 void CSWBattery::setHandlerOnBatteryEmpty(VoidFunctionWithNoParameters f) {
   emptyBatteryHandler = f;
 }
@@ -727,14 +1318,33 @@ void CSWBattery::setHandlerOnBatteryLevelChange(VoidFunctionWithNoParameters f)
   changeBatteryLevelHandler = f;
 }
 
+void CSWBattery::setHandlerOnMeasurementDone(VoidFunctionWithNoParameters f) {
+  measurementDoneHandler = f;
+}
+
+void CSWBattery::setHandlerOnCalibrationProgress(VoidFunctionWithNoParameters f) {
+  calibrationProgressHandler = f;
+}
+
+void CSWBattery::setHandlerOnCalibrationDone(VoidFunctionWithNoParameters f) {
+  calibrationDoneHandler = f;
+}
+
 void CSWBattery_tick(void * c) {
   CSWBattery * __battery = static_cast<CSWBattery *>(c);
+  __battery->_tick_task_ready.take(CSWBatteryHAL::WAIT_FOREVER);
   for(;;) {
-    if(!__battery->checkIfCollectingData()) break;
+    if((!__battery->checkIfCollectingData()) || (__battery->_manager != NULL)) break;
     __battery->tick();
+#if CSWBATTERY_STATS
+    __battery->_stats.setStackHighWater(CSWBatteryHAL::getStackHighWater());
+#endif
+    // requestRefresh() from the handler of this tick - one more pass right away
+    if(__battery->_refresh_requested.load()) continue;
     unsigned long __min_t = CSWBattery::MIN_TASK_DELAY_S;
-    vTaskDelay(max(__battery->getTimeRecheckS(),__min_t) * mS_TO_S_FACTOR / portTICK_PERIOD_MS);
+    // sleeps till the next tick unless it is woken up by stopCollectingData() or requestRefresh()
+    CSWBatteryHAL::waitForNotification(max(__battery->getTimeRecheckS(),__min_t) * mS_TO_S_FACTOR);
   }
-  __battery->stopCollectingData();
-  vTaskDelete(NULL);
-}
\ No newline at end of file
+  __battery->_tick_task.store(NULL);
+  CSWBatteryHAL::deleteCurrentTask();
+}
@@ -11,16 +11,132 @@
 #ifndef CSWBattery_h
 #define CSWBattery_h
 #include <stdint.h>
-#include <deque>
+#include <stddef.h>
+#include "CSWBatteryRingBuffer.h"
+#include "CSWBatteryLog.h"
+#include "CSWBatteryCurve.h"
+#include "CSWBatterySnapshot.h"
+#include "CSWBatteryStorage.h"
+#include "CSWBatteryFilter.h"
+#include "CSWBatteryManager.h"
+#include "CSWBatterySignal.h"
+#include "CSWBatteryHistory.h"
+#include "CSWBatteryEstimator.h"
+#include "CSWBatteryStats.h"
+#include "CSWBatteryTrace.h"
+#include "CSWBatteryProfile.h"
+#include "CSWBatteryBackend.h"
+
+// Battery data is kept for CSWBATTERY_TIME_LIMIT_S seconds and rechecked every
+// CSWBATTERY_TIME_RECHECK_S seconds (CSWBATTERY_TIME_RECHECK_MIN_S at the most often) -
+// so the buffer size is known beforehand.
+#ifndef CSWBATTERY_TIME_LIMIT_S
+#define CSWBATTERY_TIME_LIMIT_S 60
+#endif
+#ifndef CSWBATTERY_TIME_RECHECK_S
+#define CSWBATTERY_TIME_RECHECK_S 10
+#endif
+// Shortest interval the adaptive sampling may use
+#ifndef CSWBATTERY_TIME_RECHECK_MIN_S
+#define CSWBATTERY_TIME_RECHECK_MIN_S 5
+#endif
+// Longest interval - the window has to keep 3 checks (batteryChecksMinThreshold) for the average,
+// so it is never longer than CSWBATTERY_TIME_LIMIT_S / 3
+#ifndef CSWBATTERY_TIME_RECHECK_MAX_S
+#define CSWBATTERY_TIME_RECHECK_MAX_S (CSWBATTERY_TIME_LIMIT_S / 3)
+#endif
+#ifndef CSWBATTERY_TIME_RECHECK_STEP_S
+#define CSWBATTERY_TIME_RECHECK_STEP_S 5
+#endif
+// Adaptive sampling: the change between two ticks up to this one is "stable"...
+#ifndef CSWBATTERY_ADAPTIVE_STABLE_CHANGE_MV
+#define CSWBATTERY_ADAPTIVE_STABLE_CHANGE_MV 10
+#endif
+// ...and starting with this one is the "heavy load"
+#ifndef CSWBATTERY_ADAPTIVE_FAST_CHANGE_MV
+#define CSWBATTERY_ADAPTIVE_FAST_CHANGE_MV 50
+#endif
+// Sample often when the percentage is this close to the low battery threshold
+#ifndef CSWBATTERY_ADAPTIVE_LOW_MARGIN
+#define CSWBATTERY_ADAPTIVE_LOW_MARGIN 5
+#endif
+// The checks are never closer than CSWBATTERY_TIME_RECHECK_MIN_S - the refresh ticks
+// which come sooner are not added to the collected data, so no check of the window is dropped
+#define CSWBATTERY_CHECKS_CAPACITY (CSWBATTERY_TIME_LIMIT_S / CSWBATTERY_TIME_RECHECK_MIN_S + 1)
+static_assert(CSWBATTERY_TIME_RECHECK_S >= CSWBATTERY_TIME_RECHECK_MIN_S, "CSWBATTERY_TIME_RECHECK_S can't be below CSWBATTERY_TIME_RECHECK_MIN_S.");
+// Burst sampling: readings further than this number of median absolute deviations from the median are rejected
+#ifndef CSWBATTERY_BURST_OUTLIER_MADS
+#define CSWBATTERY_BURST_OUTLIER_MADS 3
+#endif
+#ifndef CSWBATTERY_BURST_MAX_SAMPLES
+#define CSWBATTERY_BURST_MAX_SAMPLES 32
+#endif
+// Median absolute deviation (mV) at which the confidence of the burst is halved
+#ifndef CSWBATTERY_BURST_NOISE_MV
+#define CSWBATTERY_BURST_NOISE_MV 20
+#endif
+// Changes of the burst which are within this number of the median absolute deviations of the
+// readings from the last value are the flukes - a real change stands out of the noise, however noisy it is
+#ifndef CSWBATTERY_BURST_FLUKE_MADS
+#define CSWBATTERY_BURST_FLUKE_MADS 4
+#endif
+// Stack of the sampling task (bytes)
+#ifndef CSWBATTERY_TASK_STACK_SIZE
+#define CSWBATTERY_TASK_STACK_SIZE 4096
+#endif
+// Entries of the millivolts table of the profile - one for each possible ADC reading. The ADCs
+// of more bits (or all of them with 0) convert the readings with the fixed point math instead
+#ifndef CSWBATTERY_ADC_RESOLUTION
+#define CSWBATTERY_ADC_RESOLUTION 4096
+#endif
 
 struct batteryCheck {
   unsigned long time_checked=0;
   float         voltage=-1;
+  long          millivolts=-1;
   int           percentage=-1;
   int           section=-1;
 };
 
-typedef std::deque<batteryCheck> t_batteryCheck;
+struct batteryBurst {
+  long          millivolts=-1;  // average of the readings which are not the outliers
+  float         confidence=0;   // 0..1
+  long          spread_mv=0;    // median absolute deviation of the readings
+  int           samples=0;
+  int           rejected=0;
+};
+
+typedef CSWBatteryChecksBuffer<batteryCheck, CSWBATTERY_CHECKS_CAPACITY> t_batteryCheck;
+
+// Compact state kept in the RTC memory during the deep sleep - see CSWBattery::saveState()
+// Calibration results kept in the CSWBatteryStorage - see CSWBattery::saveCalibration()
+struct batteryCalibrationRecord {
+  uint32_t      magic;
+  uint16_t      version;
+  uint16_t      size;
+  float         battery_cf;
+  uint8_t       calibrated;
+  uint8_t       reserved[3];
+  uint32_t      crc;
+};
+
+struct batteryRtcCheck {
+  uint16_t      age_ds;         // age of the check at the moment of saving, 1/10 s
+  uint16_t      millivolts;
+};
+struct batteryRtcState {
+  uint32_t      magic;
+  uint8_t       version;
+  uint8_t       count;
+  uint8_t       flags;          // 1 - charging, 2 - calibrated
+  int8_t        last_section;
+  int16_t       last_percentage;
+  uint16_t      time_recheck_s;
+  float         last_voltage;
+  float         battery_cf;
+  batteryRtcCheck checks[CSWBATTERY_CHECKS_CAPACITY];
+  uint32_t      crc;
+};
 typedef void (*VoidFunctionWithNoParameters) (void);
 
 void CSWBattery_tick(void * c);
@@ -29,9 +145,14 @@ class CSWBattery {
   public:
     // Constants
     enum data_receiving_type {instantReceive,averageReceive};
+    enum measurement_state {measurementIdle,measurementInProgress,measurementDone,measurementCancelled};
+    enum calibration_state {calibrationIdle,calibrationReference,calibrationWaitingForUnplug,calibrationSettling,calibrationMeasuring,calibrationDone,calibrationCancelled};
 
     // init
     CSWBattery(int battery_pin=-100, int precision=-100);
+    virtual ~CSWBattery() {}
+    // CSWBATTERY_PROFILE; the batteries of CSWBatteryT<> have their own
+    virtual const batteryProfile& getProfile(void) { return CSWBatteryProfileOf<CSWBATTERY_PROFILE>::profile; }
     void        setBatteryPin(int battery_pin);
     int         getBatteryPin();
     int         getVoltagePrecision();
@@ -42,13 +163,46 @@ class CSWBattery {
 
     // Get battery data
     float       getBatteryVoltage(bool no_update=false, bool get_raw=false, int override_precision=-1, bool check_thoroughly=false, bool use_default_cf=false, int override_num_checks_thoroughly=-1, bool force_instant_value=false, bool force_average_value=false);
+    // Modes of readBatteryVoltage<>() - combine them with |
+    static const unsigned READ_DEFAULT=0;
+    static const unsigned READ_NO_UPDATE=1;   // keep the last battery voltage
+    static const unsigned READ_RAW=2;         // without the battery coefficient
+    static const unsigned READ_THOROUGH=4;    // several readings with the delays
+    static const unsigned READ_DEFAULT_CF=8;  // with the default battery coefficient
+    static const unsigned READ_INSTANT=16;    // never the collected average
+    static const unsigned READ_AVERAGE=32;    // -100 if there is not enough of the collected data
+    template<unsigned MODE> float readBatteryVoltage(int override_precision=-1, int override_num_checks=-1);
     int         getBatteryVoltageSection(bool no_update=false, bool check_thoroughly=false, bool force_instant_check=false);
     int         getBatteryVoltagePercentage(bool no_update=false, bool check_thoroughly=false, bool force_instant_value=false);
     int         getBatteryLowThreshold(void);
+    BatterySnapshot getBatterySnapshot(void);
+    bool        checkIfSnapshotAvailable(void);
+    float       convertRawToVoltage(int raw, float cf, int precision);
+    virtual int convertRawToMillivolts(int raw, uint32_t scale=0);
+    virtual uint32_t getMillivoltsScale(float cf);
+    float       quantizeMillivolts(long mv, int precision);
+    batteryBurst sampleBurst(int num_samples=-1, uint32_t scale=0);
+    int         convertVoltageToSection(float v);
+    int         convertVoltageToPercentage(float v);
+    void        setDischargeCurve(const batteryCurvePoint * points, int num_points);
+    void        resetDischargeCurve(void);
+    const CSWBatteryCurve& getDischargeCurve(void);
+    long        getEmptyMillivolts(void);
+    float       roundVoltage(float v, int precision);
+
+    // Non-blocking measurement - start it and then poll() from the loop or a timer
+    bool        startMeasurement(int num_checks=-1, bool use_default_cf=false);
+    measurement_state pollMeasurement(void);
+    measurement_state getMeasurementState(void);
+    bool        checkIfMeasurementReady(void);
+    float       getMeasuredBatteryVoltage(void);
+    void        cancelMeasurement(void);
 
     // Different checkers
     bool        checkIfWeAreCharging(bool force_instant_check=false);
     bool        checkIfEmpty(void);
+    virtual bool checkIfEmptyVoltage(float v);
+    virtual bool checkIfChargingVoltage(float v);
     bool        checkIfLow(void);
     bool        checkBatteryVoltageChanged(int check_type=-1, bool force_instant_check=false);
 
@@ -66,6 +220,13 @@ class CSWBattery {
     // Calibration
     void        calibrateBattery(int precision=1);
     void        stopCalibration(void);
+    bool        startCalibration(int precision=1);
+    calibration_state pollCalibration(void);
+    calibration_state getCalibrationState(void);
+    bool        checkIfCalibrating(void);
+    void        setCalibrationStorage(CSWBatteryStorage * storage, const char * key="cswb_cal");
+    bool        saveCalibration(void);
+    bool        loadCalibration(void);
     void        resetBattery();
     void        setBatteryIsCalibrated(bool cs=true);
     bool        getBatteryIsCalibrated();
@@ -80,7 +241,30 @@ class CSWBattery {
     void        stopCollectingData(void);
     bool        checkIfCollectingData(void);
     void        flushCollectingDataBuffer(void);
+    bool        requestRefresh(unsigned long timeout_ms=0);
+    void        setBatteryFilter(CSWBatteryFilter * f);
+    CSWBatteryFilter * getBatteryFilter(void);
+    void        setBatteryHistory(CSWBatteryHistory * h);
+    CSWBatteryHistory * getBatteryHistory(void);
+    void        setTraceRecorder(CSWBatteryTraceRecorder * r);
+    CSWBatteryTraceRecorder * getTraceRecorder(void);
+    bool        setBatteryBackend(CSWBatteryBackend * b);
+    CSWBatteryBackend * getBatteryBackend(void);
+    long        getMinutesToEmpty(void);
+    long        getMinutesToFull(void);
+    float       getEstimateConfidence(void);
+    void        setChargedVoltage(float v);
+    void        setBatteryCheckTimes(int c);
+    int         getBatteryCheckTimes(void);
+    size_t      saveState(void * buf, size_t len);
+    bool        restoreState(const void * buf, size_t len, unsigned long slept_ms=0);
     unsigned long getTimeRecheckS(void);
+    void        setAdaptiveSampling(bool a=true);
+    bool        getAdaptiveSampling(void);
+    void        setTimeRecheckLimits(unsigned long min_s, unsigned long max_s, unsigned long step_s=CSWBATTERY_TIME_RECHECK_STEP_S);
+    unsigned long getTimeRecheckMinS(void);
+    unsigned long getTimeRecheckMaxS(void);
+    unsigned long getTimeRecheckStepS(void);
     void        setBatteryCheckType(int check_type=1);
     int         getBatteryCheckType(void);
     void        setBatteryLowThreshold(int t);
@@ -88,8 +272,13 @@ class CSWBattery {
     //events
     void        setHandlerOnBatteryEmpty(VoidFunctionWithNoParameters f);
     void        setHandlerOnBatteryLevelChange(VoidFunctionWithNoParameters f);
+    void        setHandlerOnMeasurementDone(VoidFunctionWithNoParameters f);
+    void        setHandlerOnCalibrationProgress(VoidFunctionWithNoParameters f);
+    void        setHandlerOnCalibrationDone(VoidFunctionWithNoParameters f);
     
     // Debug
+    batteryStats getStats(void);
+    void        resetStats(void);
     void        setDebugLevel(int d=1);
     int         getDebugLevel(void);
     void        setDebug(bool d);
@@ -98,13 +287,27 @@ class CSWBattery {
 
     // Constants
     static const int MIN_TASK_DELAY_S=1;
+    // Notification bits of the sampling task (and of the CSWBatteryManager task)
+    static const uint32_t NOTIFY_STOP=0x01;
+    static const uint32_t NOTIFY_RESCHEDULE=0x02;
+    static const uint32_t NOTIFY_REFRESH=0x04;
+    static const uint32_t NOTIFY_ALL=0xFFFFFFFF;
+    static const size_t RTC_STATE_SIZE=sizeof(batteryRtcState);
+    static const uint32_t RTC_STATE_MAGIC=0x42575343; // "CSWB"
+    static const uint8_t RTC_STATE_VERSION=1;
+    static const uint32_t CALIBRATION_RECORD_MAGIC=0x4C414342; // "BCAL"
+    static const uint16_t CALIBRATION_RECORD_VERSION=1;
+    static const unsigned long CALIBRATION_UNPLUG_CHECK_MS=100;
+    static const unsigned long CALIBRATION_POLL_DELAY_MS=5;
   protected:
     // Constants
     // Voltages
-    const float _fully_charged_voltage=4.2;
-    const float _fully_uncharged_voltage=3.7;
-    const float _charging_threshold=4.3;
-    const float defaultBatteryCf=1.1;
+    // voltages and the ADC of the board, see CSWBatteryProfile.h. The virtual methods above are
+    // these of the profile P - the constants of the traits are folded into them
+    template<class P> int convertRawToMillivoltsOf(int raw, uint32_t scale);
+    template<class P> long getPercentageX100Of(float v);
+    template<class P> bool checkIfEmptyVoltageOf(float v) { return (v <= P::EMPTY_V) && (v >= 0); }
+    template<class P> bool checkIfChargingVoltageOf(float v);
     const int   batteryChecksMinThreshold=3;
 
     // Different settings connected to iterations and delays
@@ -122,21 +325,104 @@ class CSWBattery {
     int         _last_battery_voltage_section=-1;
     int         _last_battery_voltage_percentage=-1;
     int         _voltage_precision=1;
+    long        _last_burst_millivolts=-1;  // not rounded - the flukes are told by it
+    long        _burst_noise_mv=-1;         // median absolute deviation of the recent bursts
     int         _battery_pin=-100;
     t_batteryCheck battery_checks;
-    bool        _collecting_data_started=false;
+    CSWBatteryFilter * _battery_filter=NULL;
+    CSWBatteryHistory * _battery_history=NULL;
+    CSWBatteryTraceRecorder * _trace_recorder=NULL;
+    void        updateTraceConfig(void);
+    friend class CSWBatteryTraceReplay;
+    // the fuel gauge instead of the ADC; its last reading tells the percentage and charging
+    CSWBatteryBackend * _backend=NULL;
+    // the last reading of the gauge - written by the task which reads it, the others skip publishing meanwhile
+    CSWBatterySeqLock<batteryReading> _backend_reading;
+    std::atomic_flag _backend_writing=ATOMIC_FLAG_INIT;
+    long        readBackendMillivolts(void);
+    void        publishBackendReading(const batteryReading& r);
+    // the reading just taken: with the gauge its own state of charge and charge current,
+    // otherwise the ones of the voltage (convertVoltageToPercentage(), checkIfChargingVoltage())
+    long        getReadingPercentageX100(float v);
+    bool        checkIfChargingReading(float v);
+    int         convertReadingToPercentage(float v);
+    int         convertReadingToSection(float v);
+    virtual long getPercentageX100(float v);
+    CSWBatteryEstimator _estimator;
+    long        _charged_millivolts=-1;   // -1 - the full voltage of the profile
+    long        getChargedMillivolts(void);
+    std::atomic<bool> _collecting_data_started{false};
+    std::atomic<void *> _tick_task{NULL}; // TaskHandle_t of the own sampling task
+    CSWBatterySignal _tick_task_ready;    // given once _tick_task is stored - the task starts with it
+    CSWBatteryManager * _manager=NULL;  // set while the battery is serviced by the manager instead
+    void        waitForTickTaskExit(void);
+    // requestRefresh(): the next tick happens right away and gives the signal to the waiters
+    std::atomic<bool> _refresh_requested{false};
+    std::atomic<int> _refresh_waiters{0};
+    CSWBatterySignal _refresh_done;
+    friend class CSWBatteryManager;
+    friend void CSWBattery_tick(void * c);
     int         _check_type=1;
     bool        _battery_voltage_changed=false;
     bool        _last_charging_status=false;
+    CSWBatterySeqLock<BatterySnapshot> _snapshot;
     
+    uint32_t    _millivolts_scale=0;   // getMillivoltsScale() of the current batteryCf
+    void        updateMillivoltsScale(void);
+    long        sampleMillivolts(int num_checks, uint32_t scale=0, bool with_delays=true);
+    // the read paths of getBatteryVoltage() and readBatteryVoltage<>(); num_checks 0 - one reading without the delay
+    bool        checkIfAverageReady(void) { return battery_checks.size() >= batteryChecksMinThreshold; }
+    long        getCollectedMillivolts(void);
+    float       readAverageVoltage(bool get_raw, bool use_default_cf, bool no_update);
+    float       readInstantVoltage(int override_precision, int num_checks, bool get_raw, bool use_default_cf, bool no_update);
+    // every ADC reading, delay and handler call goes through these - they are counted
+    int         readRaw(void);
+    void        waitMs(unsigned long ms);
+    void        callHandler(VoidFunctionWithNoParameters f);
+#if CSWBATTERY_STATS
+    CSWBatteryStatsCounters _stats;
+#endif
+
     // Time data
     unsigned long _last_check_tm=0; //TODO: Obsolete? // Last time the battery level was checked 
-    unsigned long _time_limit_s=60; // Battery data saved for this amount of seconds
-    unsigned long _time_recheck_s=10; // Battery will be rechecked every this amount of seconds
+    unsigned long _time_limit_s=CSWBATTERY_TIME_LIMIT_S; // Battery data saved for this amount of seconds
+    unsigned long _time_recheck_s=CSWBATTERY_TIME_RECHECK_S; // Battery will be rechecked every this amount of seconds
+    bool        _adaptive_sampling=false;
+    unsigned long _time_recheck_min_s=CSWBATTERY_TIME_RECHECK_MIN_S;
+    unsigned long _time_recheck_max_s=CSWBATTERY_TIME_RECHECK_MAX_S;
+    unsigned long _time_recheck_step_s=CSWBATTERY_TIME_RECHECK_STEP_S;
+    unsigned long getTimeRecheckLimitS(void);
+    void        adaptTimeRecheck(long last_mv, long mv, int percentage, bool charging_status_changed);
+    bool        checkIfEmptyCollectedData(float v);
+    void        publishSnapshot(bool empty, unsigned long tm);
 
-    float       batteryCf=1.1;
+    // Percentage and sections are taken from this curve
+    CSWBatteryCurve _discharge_curve;
+    bool        _default_curve=true;    // stretched over the range of the profile
+
+    float       batteryCf;
     bool        _calibrationStatus=false;
     bool        _stop_calibration = false;
+    calibration_state _calibration_state=calibrationIdle;
+    int         _calibration_precision=1;
+    float       _calibration_reference_v=-1;
+    unsigned long _calibration_next_tm=0;
+    CSWBatteryStorage * _calibration_storage=NULL;
+    const char * _calibration_storage_key="cswb_cal";
+    void        setCalibrationState(calibration_state st);
+
+    // Non-blocking measurement
+    measurement_state _measurement_state=measurementIdle;
+    int         _measurement_num_checks=0;
+    int         _measurement_checks_done=0;
+    int         _measurement_samples=0;  // the checks which were read - the gauge may not answer
+    long        _measurement_sum=0;
+    uint32_t    _measurement_scale=0;
+    int         _measurement_precision=1;
+    bool        _measurement_update_last=true;
+    float       _measurement_voltage=-1;
+    unsigned long _measurement_last_sample_tm=0;
+    bool        startMeasurementScaled(int num_checks, uint32_t scale, int precision, bool update_last);
 
     // General config
     bool        _getAvgData=false;
@@ -145,9 +431,104 @@ class CSWBattery {
     //events
     VoidFunctionWithNoParameters emptyBatteryHandler=NULL;
     VoidFunctionWithNoParameters changeBatteryLevelHandler=NULL;
+    VoidFunctionWithNoParameters measurementDoneHandler=NULL;
+    VoidFunctionWithNoParameters calibrationProgressHandler=NULL;
+    VoidFunctionWithNoParameters calibrationDoneHandler=NULL;
 
     // Debug
     bool        DEBUG = false;
     int         DEBUG_LEVEL = 1;
 };
+
+/// @brief getBatteryVoltage() with the options fixed at compile time - every mode gets
+/// its own path without the checks of the options it doesn't use, e.g.
+/// battery.readBatteryVoltage<CSWBattery::READ_THOROUGH | CSWBattery::READ_NO_UPDATE>()
+/// @param override_precision -1 - the precision of the battery
+/// @param override_num_checks number of readings of READ_THOROUGH, -1 - setBatteryCheckTimes()
+template<unsigned MODE> float CSWBattery::readBatteryVoltage(int override_precision, int override_num_checks) {
+  bool __thorough = (MODE & READ_THOROUGH);
+  if(MODE & READ_AVERAGE) {
+    if(_getAvgData && (!this->checkIfAverageReady())) return -100;
+  }
+  if((!(MODE & READ_INSTANT)) && _getAvgData) {
+    if(!this->checkIfAverageReady()) __thorough = true; // not enough of the collected data - read it now
+    else if((override_precision == -1) && (batteryCf != 0)) return this->readAverageVoltage(MODE & READ_RAW, MODE & READ_DEFAULT_CF, MODE & READ_NO_UPDATE);
+  }
+  int __num_checks = __thorough ? ((override_num_checks == -1) ? _battery_check_times : override_num_checks) : 0;
+  return this->readInstantVoltage(override_precision, __num_checks, MODE & READ_RAW, MODE & READ_DEFAULT_CF, MODE & READ_NO_UPDATE);
+}
+
+#if CSWBATTERY_ADC_RESOLUTION > 0
+/// @brief ADC reading to millivolts at the default coefficient of the profile - one table
+/// (2 bytes per reading) for all the batteries of it, built on the first use. The calibrated
+/// batteries get the same millivolts from the fixed point math
+template<class P> struct CSWBatteryMillivoltsTable {
+  static const bool USED = (1UL << P::ADC_BITS) <= CSWBATTERY_ADC_RESOLUTION;
+  static const uint16_t * get(void) {
+    static uint16_t __table[USED ? (1UL << P::ADC_BITS) : 1];
+    static const bool __built = build(__table);
+    (void)__built;
+    return __table;
+  }
+  protected:
+    static bool build(uint16_t * table) {
+      for(uint32_t i=0;i<=CSWBatteryProfileOf<P>::MAX_RAW;i++) {
+        uint32_t __mv = (i * CSWBatteryProfileOf<P>::DEFAULT_SCALE + 32768) >> 16;
+        table[i] = (__mv > 0xFFFF) ? 0xFFFF : __mv;
+      }
+      return true;
+    }
+};
+#endif
+
+/// @brief Convert the ADC reading of the battery pin to millivolts
+/// @param raw value returned by analogRead
+/// @param scale see getMillivoltsScale; 0 - the current coefficient
+template<class P> int CSWBattery::convertRawToMillivoltsOf(int raw, uint32_t scale) {
+  if(raw < 0) raw = 0;
+  if((uint32_t)raw > CSWBatteryProfileOf<P>::MAX_RAW) raw = CSWBatteryProfileOf<P>::MAX_RAW;
+#if CSWBATTERY_ADC_RESOLUTION > 0
+  if((scale == 0) && CSWBatteryMillivoltsTable<P>::USED && (_millivolts_scale == CSWBatteryProfileOf<P>::DEFAULT_SCALE)) return CSWBatteryMillivoltsTable<P>::get()[raw];
+#endif
+  // the calibrated coefficient may be far above the default one - 16 bits reading * scale doesn't fit 32 bits then
+  uint64_t __mv = ((uint64_t)raw * ((scale != 0) ? scale : _millivolts_scale) + 32768) >> 16;
+  return (__mv > 0xFFFF) ? 0xFFFF : (int)__mv;
+}
+
+/// @brief State of charge of the voltage from the discharge curve
+/// @return percentage multiplied by 100 (0..10000)
+template<class P> long CSWBattery::getPercentageX100Of(float v) {
+  typedef CSWBatteryProfileOf<P> profile;
+  long __mv = lround(v * 1000) / P::CELLS;
+  // the default curve is the one of the 3.7V - 4.2V cell: it is stretched over the empty - full
+  // range of the profile (nothing to do for the profiles of that range - it is folded away)
+  const long __empty = CSWBATTERY_LIPO_CURVE[0].millivolts;
+  const long __full = CSWBATTERY_LIPO_CURVE[sizeof(CSWBATTERY_LIPO_CURVE)/sizeof(CSWBATTERY_LIPO_CURVE[0]) - 1].millivolts;
+  if(_default_curve && ((profile::EMPTY_CELL_MV != __empty) || (profile::FULL_CELL_MV != __full))) {
+    __mv = __empty + ((__mv - profile::EMPTY_CELL_MV) * (__full - __empty) + (profile::FULL_CELL_MV - profile::EMPTY_CELL_MV) / 2) / (profile::FULL_CELL_MV - profile::EMPTY_CELL_MV);
+  }
+  return _discharge_curve.getPercentageX100(__mv);
+}
+
+/// @brief If the voltage is the one of the charger attached
+template<class P> bool CSWBattery::checkIfChargingVoltageOf(float v) {
+  return v >= P::CHARGING_V;
+}
+
+/// @brief The battery of the other board or pack: CSWBatteryT<CSWBatteryProfileESP32S3> battery(34);
+/// The profile is checked at compile time and folded into the conversions of the battery
+template<class P> class CSWBatteryT : public CSWBattery {
+  public:
+    CSWBatteryT(int battery_pin=-100, int precision=-100) : CSWBattery(battery_pin, precision) {
+      batteryCf = P::DEFAULT_CF;
+      this->updateMillivoltsScale();
+    }
+    const batteryProfile& getProfile(void) { return CSWBatteryProfileOf<P>::profile; }
+    int         convertRawToMillivolts(int raw, uint32_t scale=0) { return this->convertRawToMillivoltsOf<P>(raw, scale); }
+    uint32_t    getMillivoltsScale(float cf) { return CSWBatteryProfileOf<P>::getMillivoltsScale(cf); }
+    bool        checkIfEmptyVoltage(float v) { return this->checkIfEmptyVoltageOf<P>(v); }
+    bool        checkIfChargingVoltage(float v) { return this->checkIfChargingVoltageOf<P>(v); }
+  protected:
+    long        getPercentageX100(float v) { return this->getPercentageX100Of<P>(v); }
+};
 #endif
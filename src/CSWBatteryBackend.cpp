@@ -0,0 +1,106 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryBackend.cpp
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Fuel gauge backends.
+  *
+  ******************************************************************************
+  */
+#include <string.h>
+#include "CSWBatteryBackend.h"
+#if defined(ARDUINO) && CSWBATTERY_I2C
+#include <Wire.h>
+#endif
+
+#if defined(ARDUINO)
+#if CSWBATTERY_I2C
+bool CSWBatteryHAL::i2cRead(uint8_t address, uint8_t reg, uint8_t * buf, size_t len) {
+  Wire.beginTransmission(address);
+  Wire.write(reg);
+  if(Wire.endTransmission(false) != 0) return false;
+  if(Wire.requestFrom(address, (uint8_t)len) != len) return false;
+  for(size_t i=0;i<len;i++) buf[i] = Wire.read();
+  return true;
+}
+
+bool CSWBatteryHAL::i2cWrite(uint8_t address, uint8_t reg, const uint8_t * buf, size_t len) {
+  Wire.beginTransmission(address);
+  Wire.write(reg);
+  Wire.write(buf, len);
+  return Wire.endTransmission() == 0;
+}
+#else
+bool CSWBatteryHAL::i2cRead(uint8_t address, uint8_t reg, uint8_t * buf, size_t len) {
+  (void)address; (void)reg; (void)buf; (void)len;
+  return false;
+}
+
+bool CSWBatteryHAL::i2cWrite(uint8_t address, uint8_t reg, const uint8_t * buf, size_t len) {
+  (void)address; (void)reg; (void)buf; (void)len;
+  return false;
+}
+#endif
+#endif
+
+// registers of the gauge are 16 bits, MSB first
+bool CSWBatteryMAX17048::readRegister(uint8_t reg, uint16_t& v) {
+  uint8_t __buf[2];
+  if(!CSWBatteryHAL::i2cRead(_address, reg, __buf, 2)) return false;
+  v = ((uint16_t)__buf[0] << 8) | __buf[1];
+  return true;
+}
+
+/// @brief Check that the gauge answers
+bool CSWBatteryMAX17048::begin(void) {
+  return this->readRegister(REG_VERSION, _version);
+}
+
+bool CSWBatteryMAX17048::read(batteryReading& r) {
+  uint16_t __vcell, __soc, __crate;
+  if((!this->readRegister(REG_VCELL, __vcell)) || (!this->readRegister(REG_SOC, __soc))) return false;
+  // 78.125 uV = 5/64 mV
+  r.millivolts = ((long)__vcell * 5 * _cells + 32) / 64;
+  r.percentage_x100 = ((long)__soc * 100 + 128) / 256;
+  if(r.percentage_x100 > 10000) r.percentage_x100 = 10000;
+  // the first revisions have no CRATE - the charging threshold of the voltage decides then
+  r.charging = -1;
+  if(this->readRegister(REG_CRATE, __crate)) r.charging = ((long)(int16_t)__crate * 208 / 10 >= CSWBATTERY_GAUGE_CHARGING_RATE) ? 1 : 0;
+  return true;
+}
+
+#if !defined(ARDUINO)
+CSWBatterySimMAX17048::CSWBatterySimMAX17048() {
+  memset(_registers, 0, sizeof(_registers));
+  this->setRegister(CSWBatteryMAX17048::REG_VERSION, 0x0012);
+  this->setRegister(CSWBatteryMAX17048::REG_CONFIG, 0x971C);
+  this->setCell(3900, 5000);
+}
+
+void CSWBatterySimMAX17048::setRegister(uint8_t reg, uint16_t v) {
+  _registers[reg] = v >> 8;
+  _registers[(uint8_t)(reg + 1)] = v & 0xFF;
+}
+
+void CSWBatterySimMAX17048::setCell(long millivolts, long percentage_x100, long rate_x100) {
+  this->setRegister(CSWBatteryMAX17048::REG_VCELL, (uint16_t)(millivolts * 64 / 5));
+  this->setRegister(CSWBatteryMAX17048::REG_SOC, (uint16_t)(percentage_x100 * 256 / 100));
+  this->setRegister(CSWBatteryMAX17048::REG_CRATE, (uint16_t)(int16_t)(rate_x100 * 10 / 208));
+}
+
+bool CSWBatterySimMAX17048::readRegisters(uint8_t reg, uint8_t * buf, size_t len) {
+  if(!_ack) return false;
+  _reads++;
+  for(size_t i=0;i<len;i++) buf[i] = _registers[(uint8_t)(reg + i)];
+  return true;
+}
+
+bool CSWBatterySimMAX17048::writeRegisters(uint8_t reg, const uint8_t * buf, size_t len) {
+  if(!_ack) return false;
+  // the measurements are read only
+  if((reg < CSWBatteryMAX17048::REG_MODE) || (reg == CSWBatteryMAX17048::REG_VERSION) || (reg == CSWBatteryMAX17048::REG_CRATE)) return false;
+  for(size_t i=0;i<len;i++) _registers[(uint8_t)(reg + i)] = buf[i];
+  return true;
+}
+#endif
@@ -0,0 +1,87 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryBackend.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Measurement backends - the battery read by a fuel gauge instead of
+  *          the ADC of the battery pin.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryBackend_h
+#define CSWBatteryBackend_h
+#include <stdint.h>
+#include <stddef.h>
+#include "CSWBatteryHAL.h"
+
+// 0 - the library is built without Wire (no gauge on I2C answers then)
+#ifndef CSWBATTERY_I2C
+#define CSWBATTERY_I2C 1
+#endif
+// Charge rate (0.01 %/h) from which the gauge is taken as charging
+#ifndef CSWBATTERY_GAUGE_CHARGING_RATE
+#define CSWBATTERY_GAUGE_CHARGING_RATE 100
+#endif
+
+struct batteryReading {
+  long          millivolts=-1;        // -1 - the reading failed
+  long          percentage_x100=-1;   // state of charge (0..10000); -1 - the discharge curve tells
+  int           charging=-1;          // 1 or 0; -1 - the charging threshold of the voltage tells
+};
+
+/// @brief Source of the readings of the battery. The ADC of the battery pin is used without it
+class CSWBatteryBackend {
+  public:
+    virtual ~CSWBatteryBackend() {}
+    virtual bool begin(void) { return true; }
+    virtual bool read(batteryReading& r) = 0;
+    // the device filters the readings itself - one is enough, without the bursts and delays
+    virtual bool checkIfFiltered(void) { return true; }
+};
+
+/// @brief MAX17048/MAX17049 fuel gauge (ModelGauge, no sense resistor) on I2C
+class CSWBatteryMAX17048 : public CSWBatteryBackend {
+  public:
+    static const uint8_t ADDRESS=0x36;
+    static const uint8_t REG_VCELL=0x02;      // 78.125 uV per cell per LSB
+    static const uint8_t REG_SOC=0x04;        // 1/256 %
+    static const uint8_t REG_MODE=0x06;
+    static const uint8_t REG_VERSION=0x08;
+    static const uint8_t REG_CONFIG=0x0C;
+    static const uint8_t REG_CRATE=0x16;      // signed, 0.208 %/h
+    static const uint8_t REG_CMD=0xFE;
+
+    // cells: 1 - MAX17048, 2 - MAX17049
+    CSWBatteryMAX17048(uint8_t address=ADDRESS, uint8_t cells=1) : _address(address), _cells(cells) {}
+    bool        begin(void);
+    bool        read(batteryReading& r);
+    uint16_t    getVersion(void) const { return _version; }
+  protected:
+    uint8_t     _address;
+    uint8_t     _cells;
+    uint16_t    _version=0;
+    bool        readRegister(uint8_t reg, uint16_t& v);
+};
+
+#if !defined(ARDUINO)
+/// @brief Software MAX17048 for the simulator (CSWBatteryHAL.h):
+/// sim.attachI2cDevice(CSWBatteryMAX17048::ADDRESS, &gauge);
+class CSWBatterySimMAX17048 : public CSWBatterySimI2cDevice {
+  public:
+    CSWBatterySimMAX17048();
+    // voltage of the cell, state of charge (0.01 %) and charge rate (0.01 %/h, negative - discharge)
+    void        setCell(long millivolts, long percentage_x100, long rate_x100=0);
+    // false - the gauge doesn't answer
+    void        setAcknowledge(bool ack) { _ack = ack; }
+    unsigned long getReadsCount(void) const { return _reads; }
+    bool        readRegisters(uint8_t reg, uint8_t * buf, size_t len);
+    bool        writeRegisters(uint8_t reg, const uint8_t * buf, size_t len);
+  protected:
+    uint8_t     _registers[256];
+    bool        _ack=true;
+    unsigned long _reads=0;
+    void        setRegister(uint8_t reg, uint16_t v);
+};
+#endif
+#endif
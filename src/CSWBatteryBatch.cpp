@@ -0,0 +1,179 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryBatch.cpp
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Bulk conversion of the raw ADC readings on the Linux host.
+  *
+  ******************************************************************************
+  */
+#if !defined(ARDUINO)
+#include "CSWBatteryBatch.h"
+#include "CSWBattery.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CSWBATTERY_BATCH_X86 1
+#include <immintrin.h>
+#endif
+
+// readings converted at once before their percentage and sections are looked up
+#define CSWBATTERY_BATCH_BLOCK 256
+// quantized millivolts never go above this
+#define CSWBATTERY_BATCH_MAX_MV 66000
+
+CSWBatteryBatch::CSWBatteryBatch(CSWBattery& battery) {
+  _scale = battery.getMillivoltsScale(battery.getBatteryCoefficient(false));
+  _precision = battery.getVoltagePrecision();
+  _max_raw = (1UL << battery.getProfile().adc_bits) - 1;
+  _max_raw_32 = min(_max_raw, (uint32_t)((0xFFFFFFFFUL - 32768) / max(_scale, (uint32_t)1)));
+  // x / 10 = (x >> 1) / 5, x / 100 = (x >> 2) / 25, x / 1000 = (x >> 3) / 125 - the reciprocals
+  // are exact for all the millivolts the 16 bits table may give
+  _q_round = 0; _q_shift = 0; _q_mul = 1; _q_mul_shift = 0; _q_step = 1;
+  if(_precision == 2) { _q_round = 5; _q_shift = 1; _q_mul = 52429; _q_mul_shift = 18; _q_step = 10; }
+  else if(_precision == 1) { _q_round = 50; _q_shift = 2; _q_mul = 41944; _q_mul_shift = 20; _q_step = 100; }
+  else if(_precision < 1) { _q_shift = 3; _q_mul = 16778; _q_mul_shift = 21; _q_step = 1000; }
+  // the charging threshold in the quantized millivolts - the voltage only grows with them
+  long __lo = 0;
+  long __hi = CSWBATTERY_BATCH_MAX_MV;
+  while(__lo < __hi) {
+    long __mid = (__lo + __hi) / 2;
+    if(battery.convertVoltageToPercentage(battery.quantizeMillivolts(__mid, _precision)) == -1) __hi = __mid; else __lo = __mid + 1;
+  }
+  _charging_mv = __lo;
+  // below the empty end of the curve nothing changes
+  _lowest_mv = min(battery.getEmptyMillivolts(), _charging_mv);
+  _levels.resize(_charging_mv - _lowest_mv + 1);
+  for(long __mv=_lowest_mv;__mv<=_charging_mv;__mv++) {
+    float __v = battery.quantizeMillivolts(__mv, _precision);
+    int __percentage = battery.convertVoltageToPercentage(__v);
+    int __section = battery.convertVoltageToSection(__v);
+    _levels[__mv - _lowest_mv] = (int32_t)(((uint32_t)__section << 16) | (uint16_t)__percentage);
+  }
+  for(int __k=KERNEL_AVX2;__k>KERNEL_SCALAR;__k--) {
+    if(this->setKernel(__k)) break;
+  }
+}
+
+bool CSWBatteryBatch::checkIfKernelSupported(int kernel) {
+  if(kernel == KERNEL_SCALAR) return true;
+#if CSWBATTERY_BATCH_X86
+  __builtin_cpu_init();
+  if(kernel == KERNEL_SSE41) return __builtin_cpu_supports("sse4.1");
+  if(kernel == KERNEL_AVX2) return __builtin_cpu_supports("avx2");
+#endif
+  return false;
+}
+
+bool CSWBatteryBatch::setKernel(int kernel) {
+  if(!checkIfKernelSupported(kernel)) return false;
+  _kernel = kernel;
+  return true;
+}
+
+/// @brief Convert the readings
+/// @param raw readings of the battery pin
+/// @param millivolts getBatteryVoltage() * 1000 of every reading
+/// @param percentage getBatteryVoltagePercentage() of every reading
+/// @param section getBatteryVoltageSection() of every reading
+void CSWBatteryBatch::convert(const uint16_t * raw, size_t count, int32_t * millivolts, int8_t * percentage, int8_t * section) {
+  if((raw == NULL) || (count == 0)) return;
+  int32_t __block[CSWBATTERY_BATCH_BLOCK];
+  for(size_t __pos=0;__pos<count;__pos+=CSWBATTERY_BATCH_BLOCK) {
+    size_t __n = min(count - __pos, (size_t)CSWBATTERY_BATCH_BLOCK);
+    int32_t * __mv = (millivolts != NULL) ? millivolts + __pos : __block;
+    switch(_kernel) {
+      case KERNEL_AVX2: this->convertAvx2(raw + __pos, __n, __mv); break;
+      case KERNEL_SSE41: this->convertSse41(raw + __pos, __n, __mv); break;
+      default: this->convertScalar(raw + __pos, __n, __mv); break;
+    }
+    if((percentage != NULL) || (section != NULL)) {
+      this->putLevels(__mv, __n, (percentage != NULL) ? percentage + __pos : NULL, (section != NULL) ? section + __pos : NULL);
+    }
+  }
+}
+
+int32_t CSWBatteryBatch::convertOne(uint16_t raw) const {
+  uint32_t __raw = min((uint32_t)raw, _max_raw);
+  uint32_t __mv = (__raw > _max_raw_32) ? 0xFFFF : min((__raw * _scale + 32768) >> 16, (uint32_t)0xFFFF);
+  return ((((__mv + _q_round) >> _q_shift) * _q_mul) >> _q_mul_shift) * _q_step;
+}
+
+void CSWBatteryBatch::convertScalar(const uint16_t * raw, size_t count, int32_t * millivolts) {
+  for(size_t i=0;i<count;i++) millivolts[i] = this->convertOne(raw[i]);
+}
+
+void CSWBatteryBatch::putLevels(const int32_t * mv, size_t count, int8_t * percentage, int8_t * section) {
+  const int32_t * __levels = _levels.data();
+  for(size_t i=0;i<count;i++) {
+    long __mv = min(max((long)mv[i], _lowest_mv), _charging_mv);
+    int32_t __level = __levels[__mv - _lowest_mv];
+    if(percentage != NULL) percentage[i] = (int16_t)(__level & 0xFFFF);
+    if(section != NULL) section[i] = (int16_t)(__level >> 16);
+  }
+}
+
+#if CSWBATTERY_BATCH_X86
+__attribute__((target("sse4.1")))
+void CSWBatteryBatch::convertSse41(const uint16_t * raw, size_t count, int32_t * millivolts) {
+  const __m128i __max_raw = _mm_set1_epi32(_max_raw);
+  const __m128i __max_raw_32 = _mm_set1_epi32(_max_raw_32);
+  const __m128i __scale = _mm_set1_epi32(_scale);
+  const __m128i __half = _mm_set1_epi32(32768);
+  const __m128i __max_mv = _mm_set1_epi32(0xFFFF);
+  const __m128i __round = _mm_set1_epi32(_q_round);
+  const __m128i __shift = _mm_cvtsi32_si128(_q_shift);
+  const __m128i __mul = _mm_set1_epi32(_q_mul);
+  const __m128i __mul_shift = _mm_cvtsi32_si128(_q_mul_shift);
+  const __m128i __step = _mm_set1_epi32(_q_step);
+  size_t i = 0;
+  for(;i+4<=count;i+=4) {
+    __m128i __v = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(raw + i)));
+    __v = _mm_min_epu32(__v, __max_raw);
+    __m128i __over = _mm_cmpgt_epi32(__v, __max_raw_32);
+    __v = _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi32(__v, __scale), __half), 16);
+    __v = _mm_min_epu32(_mm_or_si128(__v, __over), __max_mv);
+    __v = _mm_srl_epi32(_mm_add_epi32(__v, __round), __shift);
+    __v = _mm_srl_epi32(_mm_mullo_epi32(__v, __mul), __mul_shift);
+    __v = _mm_mullo_epi32(__v, __step);
+    _mm_storeu_si128((__m128i *)(millivolts + i), __v);
+  }
+  for(;i<count;i++) millivolts[i] = this->convertOne(raw[i]);
+}
+
+__attribute__((target("avx2")))
+void CSWBatteryBatch::convertAvx2(const uint16_t * raw, size_t count, int32_t * millivolts) {
+  const __m256i __max_raw = _mm256_set1_epi32(_max_raw);
+  const __m256i __max_raw_32 = _mm256_set1_epi32(_max_raw_32);
+  const __m256i __scale = _mm256_set1_epi32(_scale);
+  const __m256i __half = _mm256_set1_epi32(32768);
+  const __m256i __max_mv = _mm256_set1_epi32(0xFFFF);
+  const __m256i __round = _mm256_set1_epi32(_q_round);
+  const __m128i __shift = _mm_cvtsi32_si128(_q_shift);
+  const __m256i __mul = _mm256_set1_epi32(_q_mul);
+  const __m128i __mul_shift = _mm_cvtsi32_si128(_q_mul_shift);
+  const __m256i __step = _mm256_set1_epi32(_q_step);
+  size_t i = 0;
+  for(;i+8<=count;i+=8) {
+    __m256i __v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(raw + i)));
+    __v = _mm256_min_epu32(__v, __max_raw);
+    __m256i __over = _mm256_cmpgt_epi32(__v, __max_raw_32);
+    __v = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(__v, __scale), __half), 16);
+    __v = _mm256_min_epu32(_mm256_or_si256(__v, __over), __max_mv);
+    __v = _mm256_srl_epi32(_mm256_add_epi32(__v, __round), __shift);
+    __v = _mm256_srl_epi32(_mm256_mullo_epi32(__v, __mul), __mul_shift);
+    __v = _mm256_mullo_epi32(__v, __step);
+    _mm256_storeu_si256((__m256i *)(millivolts + i), __v);
+  }
+  for(;i<count;i++) millivolts[i] = this->convertOne(raw[i]);
+}
+#else
+void CSWBatteryBatch::convertSse41(const uint16_t * raw, size_t count, int32_t * millivolts) {
+  this->convertScalar(raw, count, millivolts);
+}
+
+void CSWBatteryBatch::convertAvx2(const uint16_t * raw, size_t count, int32_t * millivolts) {
+  this->convertScalar(raw, count, millivolts);
+}
+#endif
+#endif
@@ -0,0 +1,62 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryBatch.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Bulk conversion of the logged raw ADC readings to the millivolts,
+  *          percentage and sections on the Linux host (SSE4.1/AVX2 when the
+  *          CPU has them).
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryBatch_h
+#define CSWBatteryBatch_h
+#if !defined(ARDUINO)
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class CSWBattery;
+
+/// @brief Converts the readings exactly as the battery it was made of converts
+/// the single reading: millivolts are getBatteryVoltage() * 1000, the percentage and
+/// section are the ones of getBatteryVoltagePercentage() / getBatteryVoltageSection()
+/// (-1 if charging). The settings of the battery (coefficient, precision, curve,
+/// sections) are taken by the constructor - make the new converter if they change.
+class CSWBatteryBatch {
+  public:
+    static const int KERNEL_SCALAR=0;
+    static const int KERNEL_SSE41=1;
+    static const int KERNEL_AVX2=2;
+
+    CSWBatteryBatch(CSWBattery& battery);
+    // any of the outputs may be NULL
+    void        convert(const uint16_t * raw, size_t count, int32_t * millivolts, int8_t * percentage, int8_t * section=NULL);
+    // the best one the CPU has is used by default
+    bool        setKernel(int kernel);
+    int         getKernel(void) const { return _kernel; }
+    static bool checkIfKernelSupported(int kernel);
+    // the lowest millivolts which are reported as charging
+    long        getChargingMillivolts(void) const { return _charging_mv; }
+  protected:
+    uint32_t    _scale;
+    uint32_t    _max_raw;
+    uint32_t    _max_raw_32;    // the readings above it don't fit the 32 bits math - 0xFFFF mV anyway
+    int         _precision;
+    // quantization of getBatteryVoltage() without the division: ((((mv + round) >> shift) * mul) >> mul_shift) * step
+    uint32_t    _q_round, _q_shift, _q_mul, _q_mul_shift, _q_step;
+    int         _kernel=KERNEL_SCALAR;
+    long        _lowest_mv;       // millivolts of the first entry of the table
+    long        _charging_mv;     // the last entry of the table
+    // percentage (low 16 bits) and section (high 16 bits) of every millivolt from _lowest_mv to _charging_mv
+    std::vector<int32_t> _levels;
+
+    void        convertScalar(const uint16_t * raw, size_t count, int32_t * millivolts);
+    void        convertSse41(const uint16_t * raw, size_t count, int32_t * millivolts);
+    void        convertAvx2(const uint16_t * raw, size_t count, int32_t * millivolts);
+    int32_t     convertOne(uint16_t raw) const;
+    void        putLevels(const int32_t * mv, size_t count, int8_t * percentage, int8_t * section);
+};
+#endif
+#endif
@@ -0,0 +1,80 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryCurve.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   State of charge model - the discharge curve of the cell as a
+  *          piecewise-linear table.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryCurve_h
+#define CSWBatteryCurve_h
+#include <stdint.h>
+
+struct batteryCurvePoint {
+  uint16_t      millivolts;
+  uint8_t       percentage;
+};
+
+// Typical LiPo discharge curve of the 3.7V (empty) - 4.2V (full) cell. As the default curve it is
+// stretched over the empty - full range of the profile. The middle part is flat, so the percentage does not jump.
+static constexpr batteryCurvePoint CSWBATTERY_LIPO_CURVE[] = {
+  {3700,   0},
+  {3770,   5},
+  {3790,  10},
+  {3800,  15},
+  {3820,  20},
+  {3840,  25},
+  {3850,  30},
+  {3870,  40},
+  {3910,  50},
+  {3950,  60},
+  {3980,  70},
+  {4020,  80},
+  {4080,  85},
+  {4110,  90},
+  {4150,  95},
+  {4200, 100}
+};
+
+// The straight line between empty and full - how the percentage was calculated before the curves
+static constexpr batteryCurvePoint CSWBATTERY_LINEAR_CURVE[] = {
+  {3700,   0},
+  {4200, 100}
+};
+
+/// @brief Discharge curve lookup. Points have to be sorted by the voltage.
+/// The curve itself is not copied - it has to live as long as the battery does.
+class CSWBatteryCurve {
+  public:
+    CSWBatteryCurve(const batteryCurvePoint * points=CSWBATTERY_LIPO_CURVE, int num_points=sizeof(CSWBATTERY_LIPO_CURVE)/sizeof(CSWBATTERY_LIPO_CURVE[0]))
+      : _points(points), _num_points(num_points) {}
+
+    int getNumPoints(void) const { return _num_points; }
+    const batteryCurvePoint * getPoints(void) const { return _points; }
+    long getEmptyMillivolts(void) const { return _points[0].millivolts; }
+    long getFullMillivolts(void) const { return _points[_num_points - 1].millivolts; }
+
+    /// @brief State of charge for the voltage
+    /// @return percentage multiplied by 100 (0..10000), clamped to the ends of the curve
+    long getPercentageX100(long mv) const {
+      if(mv <= _points[0].millivolts) return _points[0].percentage * 100L;
+      if(mv >= _points[_num_points - 1].millivolts) return _points[_num_points - 1].percentage * 100L;
+      // binary search of the segment: _points[lo].millivolts <= mv < _points[hi].millivolts
+      int lo = 0;
+      int hi = _num_points - 1;
+      while(hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if(_points[mid].millivolts <= mv) lo = mid; else hi = mid;
+      }
+      long __dmv = _points[hi].millivolts - _points[lo].millivolts;
+      long __dp = (_points[hi].percentage - _points[lo].percentage) * 100L;
+      return _points[lo].percentage * 100L + ((mv - _points[lo].millivolts) * __dp + __dmv / 2) / __dmv;
+    }
+  protected:
+    const batteryCurvePoint * _points;
+    int _num_points;
+};
+#endif
@@ -0,0 +1,100 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryEstimator.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Online least-squares trend of the voltage - the time to empty
+  *          (discharging) and to full (charging) without rescanning the history.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryEstimator_h
+#define CSWBatteryEstimator_h
+#include <stdint.h>
+#include <math.h>
+
+// Samples this old (seconds) weigh 1/e of the newest one
+#ifndef CSWBATTERY_ESTIMATOR_WINDOW_S
+#define CSWBATTERY_ESTIMATOR_WINDOW_S 1800
+#endif
+// Effective number of samples needed for the full confidence
+#ifndef CSWBATTERY_ESTIMATOR_MIN_SAMPLES
+#define CSWBATTERY_ESTIMATOR_MIN_SAMPLES 10
+#endif
+
+/// @brief Exponentially weighted linear regression of the millivolts over the time.
+/// The sums are kept relative to the newest sample, so every update is O(1)
+/// and the float precision does not degrade as the time goes.
+class CSWBatteryEstimator {
+  public:
+    void reset(void) {
+      _s0 = _st = _stt = _sy = _sty = _syy = 0;
+      _count = 0;
+    }
+    void update(unsigned long tm, long mv) {
+      if(_count > 0) {
+        float __dt = (tm - _last_tm) / 1000.0f;
+        // move the origin to the new sample...
+        _stt += __dt * (__dt * _s0 - 2 * _st);
+        _st -= __dt * _s0;
+        _sty -= __dt * _sy;
+        // ...and let the older samples weigh less
+        float __w = expf(-__dt / CSWBATTERY_ESTIMATOR_WINDOW_S);
+        _s0 *= __w; _st *= __w; _stt *= __w; _sy *= __w; _sty *= __w; _syy *= __w;
+      }
+      if(_count == 0) _origin_mv = mv;
+      float __y = mv - _origin_mv;
+      _s0 += 1;
+      _sy += __y;
+      _syy += __y * __y;
+      _last_tm = tm;
+      if(_count < 0x7FFF) _count++;
+    }
+    int  getCount(void) const { return _count; }
+
+    /// @brief Trend of the voltage, mV per hour (0 if it is not known yet)
+    float getSlopeMvPerHour(void) const {
+      float __d = _s0 * _stt - _st * _st;
+      if((_count < 2) || (__d <= 0)) return 0;
+      return (_s0 * _sty - _st * _sy) / __d * 3600;
+    }
+    /// @brief Fitted voltage now, mV
+    float getMillivolts(void) const {
+      if(_count == 0) return -1;
+      float __slope_s = this->getSlopeMvPerHour() / 3600;
+      return _origin_mv + (_sy - __slope_s * _st) / _s0;
+    }
+    /// @brief How well the line fits (R^2) scaled by the amount of the data, 0..1
+    float getConfidence(void) const {
+      if(_count < 2) return 0;
+      float __vt = _s0 * _stt - _st * _st;
+      float __vy = _s0 * _syy - _sy * _sy;
+      if((__vt <= 0) || (__vy <= 0)) return 0;
+      float __c = _s0 * _sty - _st * _sy;
+      float __r2 = __c * __c / (__vt * __vy);
+      float __amount = _s0 / CSWBATTERY_ESTIMATOR_MIN_SAMPLES;
+      return (__r2 > 1 ? 1 : __r2) * (__amount > 1 ? 1 : __amount);
+    }
+    /// @brief Minutes till the fitted line reaches the voltage
+    /// @return -1 if the trend goes the other way or is not known
+    long getMinutesTo(long target_mv) const {
+      float __slope = this->getSlopeMvPerHour();
+      float __delta = target_mv - this->getMillivolts();
+      if((_count >= 2) && (__delta == 0)) return 0;
+      if((_count < 2) || (__slope == 0) || ((__delta > 0) != (__slope > 0))) return -1;
+      return lroundf(__delta / __slope * 60);
+    }
+  protected:
+    // t is relative to the newest sample (seconds, <= 0), y - to the first one (mV)
+    float       _s0 = 0;
+    float       _st = 0;
+    float       _stt = 0;
+    float       _sy = 0;
+    float       _sty = 0;
+    float       _syy = 0;
+    float       _origin_mv = 0;
+    unsigned long _last_tm = 0;
+    int         _count = 0;
+};
+#endif
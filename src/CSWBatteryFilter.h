@@ -0,0 +1,112 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryFilter.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Filters of the collected battery data: exponential moving average,
+  *          1-D Kalman, windowed median and trimmed mean.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryFilter_h
+#define CSWBatteryFilter_h
+#include <stdint.h>
+#include "CSWBatteryRingBuffer.h"
+
+/// @brief Filter of the millivolts collected by the ticks. CSWBattery holds the pointer
+/// to it (setBatteryFilter()), the filter itself lives as long as the battery does.
+class CSWBatteryFilter {
+  public:
+    virtual ~CSWBatteryFilter() {}
+    virtual void    reset(void) = 0;
+    // feed the new value; returns the filtered one
+    virtual long    update(long mv) = 0;
+    // -1 if nothing was fed yet
+    virtual long    getValue(void) const = 0;
+    virtual int     getCount(void) const = 0;
+};
+
+/// @brief Exponential moving average, alpha = 1/2^SHIFT. O(1), no multiplications
+template<int SHIFT=2>
+class CSWBatteryEwmaFilter : public CSWBatteryFilter {
+  public:
+    void reset(void) { _count = 0; _value_x256 = 0; }
+    long update(long mv) {
+      if(_count == 0) _value_x256 = mv * 256;
+      else _value_x256 += (mv * 256 - _value_x256) / (1 << SHIFT);
+      if(_count < 0x7FFF) _count++;
+      return this->getValue();
+    }
+    long getValue(void) const { return (_count > 0) ? (_value_x256 + 128) / 256 : -1; }
+    int  getCount(void) const { return _count; }
+  protected:
+    long        _value_x256 = 0;
+    int         _count = 0;
+};
+
+/// @brief One dimensional Kalman filter for the slowly changing voltage
+class CSWBatteryKalmanFilter : public CSWBatteryFilter {
+  public:
+    // process_noise - how much the real voltage may change between the ticks (mV^2)
+    // measurement_noise - variance of the ADC burst (mV^2)
+    CSWBatteryKalmanFilter(float process_noise=4, float measurement_noise=400)
+      : _q(process_noise), _r(measurement_noise) {}
+    void reset(void) { _count = 0; _p = 0; _x = 0; }
+    long update(long mv) {
+      if(_count == 0) {
+        _x = mv;
+        _p = _r;
+      } else {
+        _p += _q;
+        float __k = _p / (_p + _r);
+        _x += __k * (mv - _x);
+        _p *= (1 - __k);
+      }
+      if(_count < 0x7FFF) _count++;
+      return this->getValue();
+    }
+    long getValue(void) const { return (_count > 0) ? (long)(_x + 0.5f) : -1; }
+    int  getCount(void) const { return _count; }
+  protected:
+    float       _q;
+    float       _r;
+    float       _p = 0;
+    float       _x = 0;
+    int         _count = 0;
+};
+
+/// @brief Median (TRIM = (N-1)/2) or trimmed mean of the last N values - the load spikes are cut off
+template<int N, int TRIM=(N-1)/2>
+class CSWBatteryTrimmedMeanFilter : public CSWBatteryFilter {
+  public:
+    void reset(void) { _window.clear(); }
+    long update(long mv) {
+      _window.push_back(mv);
+      return this->getValue();
+    }
+    long getValue(void) const {
+      int __n = _window.size();
+      if(__n == 0) return -1;
+      long __sorted[N];
+      for(int i=0;i<__n;i++) {
+        // insertion sort - N is small
+        long __v = _window[i];
+        int j = i;
+        while((j > 0) && (__sorted[j - 1] > __v)) { __sorted[j] = __sorted[j - 1]; j--; }
+        __sorted[j] = __v;
+      }
+      int __trim = (2 * TRIM < __n) ? TRIM : (__n - 1) / 2;
+      long __sum = 0;
+      for(int i=__trim;i<__n-__trim;i++) __sum += __sorted[i];
+      int __cnt = __n - 2 * __trim;
+      return (__sum + __cnt / 2) / __cnt;
+    }
+    int  getCount(void) const { return _window.size(); }
+  protected:
+    CSWBatteryRingBuffer<long, N> _window;
+};
+
+template<int N>
+class CSWBatteryMedianFilter : public CSWBatteryTrimmedMeanFilter<N, (N-1)/2> {};
+#endif
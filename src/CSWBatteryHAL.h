@@ -0,0 +1,185 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryHAL.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Hardware abstraction layer: the ADC, the time, the tasks and the
+  *          output. Arduino/FreeRTOS on the board; on the Linux host the
+  *          deterministic simulator with the virtual clock (CSWBatteryHAL_linux.cpp).
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryHAL_h
+#define CSWBatteryHAL_h
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(ARDUINO)
+#include <Arduino.h>
+#else
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+using std::min;
+using std::max;
+#endif
+
+typedef void (*CSWBatteryTaskFunction) (void * param);
+
+/// @brief Everything the library needs from the board. All the methods are static;
+/// on the board they are inline wrappers of the Arduino and FreeRTOS calls.
+class CSWBatteryHAL {
+  public:
+    typedef void * task_t;
+    typedef void * semaphore_t;
+    static const unsigned long WAIT_FOREVER=0xFFFFFFFF;
+
+#if defined(ARDUINO)
+    static int          readAnalog(int pin) { return analogRead(pin); }
+    static unsigned long getMillis(void) { return millis(); }
+    static unsigned long getMicros(void) { return micros(); }
+    static void         delayMs(unsigned long ms) { delay(ms); }
+    static void         print(const char * s) { if(Serial) Serial.println(s); }
+
+    // I2C registers (CSWBatteryBackend.cpp); the bus has to be started (Wire.begin()) by the sketch
+    static bool         i2cRead(uint8_t address, uint8_t reg, uint8_t * buf, size_t len);
+    static bool         i2cWrite(uint8_t address, uint8_t reg, const uint8_t * buf, size_t len);
+
+    static task_t createTask(CSWBatteryTaskFunction f, const char * name, uint32_t stack_size, void * param, int priority) {
+      TaskHandle_t __handle = NULL;
+      if(xTaskCreate(f, name, stack_size, param, priority, &__handle) != pdPASS) return NULL;
+      return (task_t)__handle;
+    }
+    static void         deleteCurrentTask(void) { vTaskDelete(NULL); }
+    static task_t       getCurrentTask(void) { return (task_t)xTaskGetCurrentTaskHandle(); }
+    static void         notifyTask(task_t task, uint32_t bits) { xTaskNotify((TaskHandle_t)task, bits, eSetBits); }
+    // returns the bits received (cleared on exit), 0 on timeout
+    static uint32_t waitForNotification(unsigned long timeout_ms) {
+      uint32_t __bits = 0;
+      xTaskNotifyWait(0, 0xFFFFFFFF, &__bits, toTicks(timeout_ms));
+      return __bits;
+    }
+    // free stack of the current task (bytes)
+    static uint32_t     getStackHighWater(void) { return uxTaskGetStackHighWaterMark(NULL); }
+
+    // binary semaphore
+    static semaphore_t  createSemaphore(void) { return (semaphore_t)xSemaphoreCreateBinary(); }
+    static void         deleteSemaphore(semaphore_t s) { vSemaphoreDelete((SemaphoreHandle_t)s); }
+    static void         giveSemaphore(semaphore_t s) { xSemaphoreGive((SemaphoreHandle_t)s); }
+    static bool         takeSemaphore(semaphore_t s, unsigned long timeout_ms) { return xSemaphoreTake((SemaphoreHandle_t)s, toTicks(timeout_ms)) == pdTRUE; }
+  protected:
+    static TickType_t   toTicks(unsigned long ms) { return (ms == WAIT_FOREVER) ? portMAX_DELAY : ms / portTICK_PERIOD_MS; }
+#else
+    static int          readAnalog(int pin);
+    static unsigned long getMillis(void);
+    static unsigned long getMicros(void);
+    static void         delayMs(unsigned long ms);
+    static void         print(const char * s);
+    static bool         i2cRead(uint8_t address, uint8_t reg, uint8_t * buf, size_t len);
+    static bool         i2cWrite(uint8_t address, uint8_t reg, const uint8_t * buf, size_t len);
+
+    static task_t       createTask(CSWBatteryTaskFunction f, const char * name, uint32_t stack_size, void * param, int priority);
+    static void         deleteCurrentTask(void);
+    static task_t       getCurrentTask(void);
+    static void         notifyTask(task_t task, uint32_t bits);
+    static uint32_t     waitForNotification(unsigned long timeout_ms);
+    static uint32_t     getStackHighWater(void);
+
+    static semaphore_t  createSemaphore(void);
+    static void         deleteSemaphore(semaphore_t s);
+    static void         giveSemaphore(semaphore_t s);
+    static bool         takeSemaphore(semaphore_t s, unsigned long timeout_ms);
+#endif
+};
+
+#if !defined(ARDUINO)
+// Number of the segments of one CSWBatterySimAdcScript
+#ifndef CSWBATTERY_SIM_SCRIPT_SEGMENTS
+#define CSWBATTERY_SIM_SCRIPT_SEGMENTS 32
+#endif
+
+// Raw ADC value of the pin at the virtual time
+typedef int (*CSWBatteryAdcSource) (void * param, int pin, uint64_t now_us);
+typedef void (*CSWBatteryPrintSink) (const char * s);
+
+struct CSWBatterySimTask;
+
+/// @brief Device on the I2C bus of the simulator, see CSWBatterySim::attachI2cDevice()
+class CSWBatterySimI2cDevice {
+  public:
+    virtual ~CSWBatterySimI2cDevice() {}
+    // false - no acknowledge
+    virtual bool readRegisters(uint8_t reg, uint8_t * buf, size_t len) = 0;
+    virtual bool writeRegisters(uint8_t reg, const uint8_t * buf, size_t len) = 0;
+};
+
+/// @brief Simulated board on the Linux host. The tasks are the threads, but only one of
+/// them runs at a time - the baton is passed when the running one waits. When all of them
+/// wait, the virtual clock jumps straight to the closest wakeup, so delay(20) costs no real time
+/// and every run is the same. The thread which creates the simulator becomes its first task;
+/// the threads without one get the default simulator. Several simulators may run in the
+/// different threads at once.
+class CSWBatterySim {
+  public:
+    CSWBatterySim();
+    ~CSWBatterySim();
+    static CSWBatterySim * getCurrent(void);
+
+    uint64_t    getMicros(void) const { return _now_us; }
+    // the current task waits for this long of the virtual time, the others run meanwhile
+    void        advance(unsigned long ms);
+    void        setAdcSource(CSWBatteryAdcSource f, void * param=NULL);
+    void        setAdcValue(int raw);
+    // virtual time taken by every analogRead (the real ADC needs about 10 us)
+    void        setAdcReadCostUs(unsigned long us);
+    void        setPrintSink(CSWBatteryPrintSink f);
+    // the device answers at the 7 bits address (NULL - nobody does)
+    void        attachI2cDevice(uint8_t address, CSWBatterySimI2cDevice * device);
+    // virtual time taken by every I2C transaction (about 200 us at 400 kHz)
+    void        setI2cCostUs(unsigned long us);
+    int         getTasksCount(void);
+
+    friend class CSWBatteryHAL;
+    friend void CSWBatterySim_run(CSWBatterySim * sim, CSWBatterySimTask * task, CSWBatteryTaskFunction f, void * param);
+  protected:
+    struct impl;
+    impl *      _impl;
+    uint64_t    _now_us=0;
+    CSWBatteryAdcSource _adc_source=NULL;
+    void *      _adc_param=NULL;
+    int         _adc_value=0;
+    unsigned long _adc_read_cost_us=0;
+    CSWBatteryPrintSink _print_sink=NULL;
+    CSWBatterySimI2cDevice * _i2c_devices[128]={};
+    unsigned long _i2c_cost_us=0;
+};
+
+/// @brief Scripted ADC source: the piecewise-linear raw value with the optional noise.
+/// Time 0 is the start of the simulation; after the last segment the last value stays.
+/// sim.setAdcSource(CSWBatterySimAdcScript::source, &script);
+class CSWBatterySimAdcScript {
+  public:
+    CSWBatterySimAdcScript(uint32_t seed=1) : _rng(seed ? seed : 1) {}
+    // the raw value goes from raw_from to raw_to during duration_ms, +-noise on every reading
+    bool        addRamp(unsigned long duration_ms, int raw_from, int raw_to, int noise=0);
+    bool        addHold(unsigned long duration_ms, int raw, int noise=0) { return this->addRamp(duration_ms, raw, raw, noise); }
+    void        clear(void) { _count = 0; _total_ms = 0; }
+    unsigned long getDurationMs(void) const { return _total_ms; }
+    int         getValue(uint64_t now_us);
+    static int  source(void * param, int pin, uint64_t now_us);
+  protected:
+    struct segment {
+      uint64_t  start_us;
+      uint64_t  duration_us;
+      int       raw_from;
+      int       raw_to;
+      int       noise;
+    };
+    segment     _segments[CSWBATTERY_SIM_SCRIPT_SEGMENTS];
+    int         _count=0;
+    unsigned long _total_ms=0;
+    uint32_t    _rng;
+};
+#endif
+#endif
@@ -0,0 +1,374 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryHAL_linux.cpp
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Linux host backend of the hardware abstraction layer: the tasks
+  *          run one at a time on the deterministic virtual clock.
+  *
+  ******************************************************************************
+  */
+#if !defined(ARDUINO)
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include "CSWBatteryHAL.h"
+
+static const uint64_t CSWBATTERY_SIM_FOREVER = UINT64_MAX;
+
+enum CSWBatterySimTaskState {simReady, simRunning, simBlocked, simFinished};
+
+struct CSWBatterySimSemaphore {
+  bool          given=false;
+  std::deque<CSWBatterySimTask *> waiters;
+};
+
+struct CSWBatterySimTask {
+  std::thread   thread;
+  const char *  name=NULL;
+  CSWBatterySimTaskState state=simReady;
+  uint64_t      wake_us=CSWBATTERY_SIM_FOREVER;
+  uint32_t      bits=0;
+  bool          waiting_notification=false;
+  CSWBatterySimSemaphore * waiting_semaphore=NULL;
+  bool          timed_out=false;
+};
+
+// Thrown inside of the task thread to leave the task function: vTaskDelete(NULL) or the end of the simulation
+struct CSWBatterySimExit {};
+
+static thread_local CSWBatterySim *     CSWBatterySim_current = NULL;
+static thread_local CSWBatterySimTask * CSWBatterySim_currentTask = NULL;
+
+struct CSWBatterySim::impl {
+  CSWBatterySim * sim;
+  std::mutex    mutex;
+  std::condition_variable cv;
+  std::vector<CSWBatterySimTask *> tasks;
+  std::deque<CSWBatterySimTask *> ready;
+  CSWBatterySimTask * running=NULL;
+  bool          shutdown=false;
+
+  // Pass the baton: the first ready task, otherwise the clock jumps to the closest wakeup
+  void runNext(void) {
+    CSWBatterySimTask * __next = NULL;
+    if(!ready.empty()) {
+      __next = ready.front();
+      ready.pop_front();
+    } else {
+      for(size_t i=0;i<tasks.size();i++) {
+        CSWBatterySimTask * __t = tasks[i];
+        if((__t->state == simBlocked) && (__t->wake_us != CSWBATTERY_SIM_FOREVER) && ((__next == NULL) || (__t->wake_us < __next->wake_us))) __next = __t;
+      }
+      if(__next == NULL) {
+        fprintf(stderr, "CSWBatterySim: every task waits forever - deadlock.\n");
+        abort();
+      }
+      if(__next->wake_us > sim->_now_us) sim->_now_us = __next->wake_us;
+      __next->timed_out = true;
+      if(__next->waiting_semaphore != NULL) {
+        std::deque<CSWBatterySimTask *>& __w = __next->waiting_semaphore->waiters;
+        for(size_t i=0;i<__w.size();i++) if(__w[i] == __next) { __w.erase(__w.begin() + i); break; }
+      }
+    }
+    __next->waiting_notification = false;
+    __next->waiting_semaphore = NULL;
+    __next->wake_us = CSWBATTERY_SIM_FOREVER;
+    __next->state = simRunning;
+    running = __next;
+    cv.notify_all();
+  }
+  // notified or the semaphore was given
+  void wake(CSWBatterySimTask * t) {
+    if(t->state != simBlocked) return;
+    t->timed_out = false;
+    t->waiting_notification = false;
+    t->waiting_semaphore = NULL;
+    t->wake_us = CSWBATTERY_SIM_FOREVER;
+    t->state = simReady;
+    ready.push_back(t);
+  }
+  void waitForBaton(std::unique_lock<std::mutex>& lock, CSWBatterySimTask * self) {
+    cv.wait(lock, [&]{ return (running == self) || shutdown; });
+    if(running != self) throw CSWBatterySimExit();
+  }
+  void block(std::unique_lock<std::mutex>& lock, CSWBatterySimTask * self, uint64_t wake_us) {
+    self->state = simBlocked;
+    self->wake_us = wake_us;
+    this->runNext();
+    this->waitForBaton(lock, self);
+  }
+  uint64_t getWakeTime(unsigned long timeout_ms) {
+    return (timeout_ms == CSWBatteryHAL::WAIT_FOREVER) ? CSWBATTERY_SIM_FOREVER : sim->_now_us + timeout_ms * 1000ULL;
+  }
+};
+
+CSWBatterySim::CSWBatterySim() : _impl(new impl) {
+  _impl->sim = this;
+  CSWBatterySimTask * __main = new CSWBatterySimTask;
+  __main->name = "main";
+  __main->state = simRunning;
+  _impl->tasks.push_back(__main);
+  _impl->running = __main;
+  CSWBatterySim_current = this;
+  CSWBatterySim_currentTask = __main;
+}
+
+/// @brief The tasks which are still there are stopped where they wait
+CSWBatterySim::~CSWBatterySim() {
+  {
+    std::unique_lock<std::mutex> __lock(_impl->mutex);
+    _impl->shutdown = true;
+    _impl->cv.notify_all();
+  }
+  for(size_t i=0;i<_impl->tasks.size();i++) {
+    if(_impl->tasks[i]->thread.joinable()) _impl->tasks[i]->thread.join();
+  }
+  for(size_t i=0;i<_impl->tasks.size();i++) delete _impl->tasks[i];
+  delete _impl;
+  if(CSWBatterySim_current == this) {
+    CSWBatterySim_current = NULL;
+    CSWBatterySim_currentTask = NULL;
+  }
+}
+
+CSWBatterySim * CSWBatterySim::getCurrent(void) {
+  // never deleted - lives as long as the thread does
+  if(CSWBatterySim_current == NULL) new CSWBatterySim();
+  return CSWBatterySim_current;
+}
+
+void CSWBatterySim::advance(unsigned long ms) {
+  std::unique_lock<std::mutex> __lock(_impl->mutex);
+  CSWBatterySimTask * __self = CSWBatterySim_currentTask;
+  if(ms == 0) {
+    // just let the other ready tasks run
+    __self->state = simReady;
+    _impl->ready.push_back(__self);
+    _impl->runNext();
+    _impl->waitForBaton(__lock, __self);
+    return;
+  }
+  _impl->block(__lock, __self, _now_us + ms * 1000ULL);
+}
+
+void CSWBatterySim::setAdcSource(CSWBatteryAdcSource f, void * param) {
+  _adc_source = f;
+  _adc_param = param;
+}
+
+void CSWBatterySim::setAdcValue(int raw) {
+  _adc_source = NULL;
+  _adc_value = raw;
+}
+
+void CSWBatterySim::setAdcReadCostUs(unsigned long us) {
+  _adc_read_cost_us = us;
+}
+
+void CSWBatterySim::setPrintSink(CSWBatteryPrintSink f) {
+  _print_sink = f;
+}
+
+void CSWBatterySim::attachI2cDevice(uint8_t address, CSWBatterySimI2cDevice * device) {
+  _i2c_devices[address & 0x7F] = device;
+}
+
+void CSWBatterySim::setI2cCostUs(unsigned long us) {
+  _i2c_cost_us = us;
+}
+
+int CSWBatterySim::getTasksCount(void) {
+  std::unique_lock<std::mutex> __lock(_impl->mutex);
+  int __count = 0;
+  for(size_t i=0;i<_impl->tasks.size();i++) if(_impl->tasks[i]->state != simFinished) __count++;
+  return __count;
+}
+
+void CSWBatterySim_run(CSWBatterySim * sim, CSWBatterySimTask * task, CSWBatteryTaskFunction f, void * param) {
+  CSWBatterySim_current = sim;
+  CSWBatterySim_currentTask = task;
+  try {
+    {
+      std::unique_lock<std::mutex> __lock(sim->_impl->mutex);
+      sim->_impl->waitForBaton(__lock, task);
+    }
+    f(param);
+  } catch(CSWBatterySimExit&) {
+  }
+  std::unique_lock<std::mutex> __lock(sim->_impl->mutex);
+  task->state = simFinished;
+  if(!sim->_impl->shutdown) sim->_impl->runNext();
+}
+
+int CSWBatteryHAL::readAnalog(int pin) {
+  CSWBatterySim * __sim = CSWBatterySim::getCurrent();
+  __sim->_now_us += __sim->_adc_read_cost_us;
+  if(__sim->_adc_source != NULL) return __sim->_adc_source(__sim->_adc_param, pin, __sim->_now_us);
+  return __sim->_adc_value;
+}
+
+bool CSWBatteryHAL::i2cRead(uint8_t address, uint8_t reg, uint8_t * buf, size_t len) {
+  CSWBatterySim * __sim = CSWBatterySim::getCurrent();
+  __sim->_now_us += __sim->_i2c_cost_us;
+  CSWBatterySimI2cDevice * __device = __sim->_i2c_devices[address & 0x7F];
+  return (__device != NULL) && __device->readRegisters(reg, buf, len);
+}
+
+bool CSWBatteryHAL::i2cWrite(uint8_t address, uint8_t reg, const uint8_t * buf, size_t len) {
+  CSWBatterySim * __sim = CSWBatterySim::getCurrent();
+  __sim->_now_us += __sim->_i2c_cost_us;
+  CSWBatterySimI2cDevice * __device = __sim->_i2c_devices[address & 0x7F];
+  return (__device != NULL) && __device->writeRegisters(reg, buf, len);
+}
+
+unsigned long CSWBatteryHAL::getMillis(void) {
+  return CSWBatterySim::getCurrent()->_now_us / 1000;
+}
+
+unsigned long CSWBatteryHAL::getMicros(void) {
+  return CSWBatterySim::getCurrent()->_now_us;
+}
+
+void CSWBatteryHAL::delayMs(unsigned long ms) {
+  CSWBatterySim::getCurrent()->advance(ms);
+}
+
+void CSWBatteryHAL::print(const char * s) {
+  CSWBatterySim * __sim = CSWBatterySim::getCurrent();
+  if(__sim->_print_sink != NULL) __sim->_print_sink(s);
+  else puts(s);
+}
+
+CSWBatteryHAL::task_t CSWBatteryHAL::createTask(CSWBatteryTaskFunction f, const char * name, uint32_t stack_size, void * param, int priority) {
+  // the threads have the default stack and all the simulated tasks are equal
+  (void)stack_size;
+  (void)priority;
+  CSWBatterySim * __sim = CSWBatterySim::getCurrent();
+  std::unique_lock<std::mutex> __lock(__sim->_impl->mutex);
+  CSWBatterySimTask * __task = new CSWBatterySimTask;
+  __task->name = name;
+  __sim->_impl->tasks.push_back(__task);
+  __sim->_impl->ready.push_back(__task);
+  __task->thread = std::thread(CSWBatterySim_run, __sim, __task, f, param);
+  return (task_t)__task;
+}
+
+void CSWBatteryHAL::deleteCurrentTask(void) {
+  throw CSWBatterySimExit();
+}
+
+CSWBatteryHAL::task_t CSWBatteryHAL::getCurrentTask(void) {
+  CSWBatterySim::getCurrent();
+  return (task_t)CSWBatterySim_currentTask;
+}
+
+void CSWBatteryHAL::notifyTask(task_t task, uint32_t bits) {
+  CSWBatterySim * __sim = CSWBatterySim::getCurrent();
+  std::unique_lock<std::mutex> __lock(__sim->_impl->mutex);
+  CSWBatterySimTask * __task = (CSWBatterySimTask *)task;
+  __task->bits |= bits;
+  if(__task->waiting_notification) __sim->_impl->wake(__task);
+}
+
+uint32_t CSWBatteryHAL::waitForNotification(unsigned long timeout_ms) {
+  CSWBatterySim * __sim = CSWBatterySim::getCurrent();
+  std::unique_lock<std::mutex> __lock(__sim->_impl->mutex);
+  CSWBatterySimTask * __self = CSWBatterySim_currentTask;
+  if((__self->bits == 0) && (timeout_ms > 0)) {
+    __self->waiting_notification = true;
+    __sim->_impl->block(__lock, __self, __sim->_impl->getWakeTime(timeout_ms));
+  }
+  uint32_t __bits = __self->bits;
+  __self->bits = 0;
+  return __bits;
+}
+
+uint32_t CSWBatteryHAL::getStackHighWater(void) {
+  // not known on the host
+  return 0;
+}
+
+CSWBatteryHAL::semaphore_t CSWBatteryHAL::createSemaphore(void) {
+  return (semaphore_t)new CSWBatterySimSemaphore;
+}
+
+void CSWBatteryHAL::deleteSemaphore(semaphore_t s) {
+  delete (CSWBatterySimSemaphore *)s;
+}
+
+void CSWBatteryHAL::giveSemaphore(semaphore_t s) {
+  CSWBatterySim * __sim = CSWBatterySim::getCurrent();
+  std::unique_lock<std::mutex> __lock(__sim->_impl->mutex);
+  CSWBatterySimSemaphore * __s = (CSWBatterySimSemaphore *)s;
+  if(__s->waiters.empty()) {
+    __s->given = true;
+    return;
+  }
+  CSWBatterySimTask * __task = __s->waiters.front();
+  __s->waiters.pop_front();
+  __sim->_impl->wake(__task);
+}
+
+bool CSWBatteryHAL::takeSemaphore(semaphore_t s, unsigned long timeout_ms) {
+  CSWBatterySim * __sim = CSWBatterySim::getCurrent();
+  std::unique_lock<std::mutex> __lock(__sim->_impl->mutex);
+  CSWBatterySimSemaphore * __s = (CSWBatterySimSemaphore *)s;
+  if(__s->given) {
+    __s->given = false;
+    return true;
+  }
+  if(timeout_ms == 0) return false;
+  CSWBatterySimTask * __self = CSWBatterySim_currentTask;
+  __self->waiting_semaphore = __s;
+  __s->waiters.push_back(__self);
+  __sim->_impl->block(__lock, __self, __sim->_impl->getWakeTime(timeout_ms));
+  return !__self->timed_out;
+}
+
+bool CSWBatterySimAdcScript::addRamp(unsigned long duration_ms, int raw_from, int raw_to, int noise) {
+  if((_count >= CSWBATTERY_SIM_SCRIPT_SEGMENTS) || (duration_ms == 0)) return false;
+  segment& __s = _segments[_count++];
+  __s.start_us = _total_ms * 1000ULL;
+  __s.duration_us = duration_ms * 1000ULL;
+  __s.raw_from = raw_from;
+  __s.raw_to = raw_to;
+  __s.noise = noise;
+  _total_ms += duration_ms;
+  return true;
+}
+
+int CSWBatterySimAdcScript::getValue(uint64_t now_us) {
+  if(_count == 0) return 0;
+  // binary search of the last segment which has started
+  int lo = 0;
+  int hi = _count - 1;
+  while(lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if(_segments[mid].start_us <= now_us) lo = mid; else hi = mid - 1;
+  }
+  const segment& __s = _segments[lo];
+  uint64_t __t = now_us - __s.start_us;
+  if(__t > __s.duration_us) __t = __s.duration_us;
+  long __raw = __s.raw_from + ((long)(__s.raw_to - __s.raw_from) * (long)__t + (long)__s.duration_us / 2) / (long)__s.duration_us;
+  if(__s.noise > 0) {
+    // xorshift32 - the same noise on every run
+    _rng ^= _rng << 13;
+    _rng ^= _rng >> 17;
+    _rng ^= _rng << 5;
+    __raw += (long)(_rng % (2 * __s.noise + 1)) - __s.noise;
+  }
+  if(__raw < 0) __raw = 0;
+  if(__raw > 0xFFFF) __raw = 0xFFFF;
+  return __raw;
+}
+
+int CSWBatterySimAdcScript::source(void * param, int pin, uint64_t now_us) {
+  (void)pin;
+  return static_cast<CSWBatterySimAdcScript *>(param)->getValue(now_us);
+}
+#endif
@@ -0,0 +1,181 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryHistory.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Long-term battery history in several resolutions (e.g. 10 s for the
+  *          last minute, 1 min for the last hour, 15 min for the last day) kept
+  *          in the fixed memory - for the battery graphs.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryHistory_h
+#define CSWBatteryHistory_h
+#include <stdint.h>
+#include <stddef.h>
+
+// Period (seconds) and number of the records of every tier
+#ifndef CSWBATTERY_HISTORY_TIER0_S
+#define CSWBATTERY_HISTORY_TIER0_S 10
+#endif
+#ifndef CSWBATTERY_HISTORY_TIER0_RECORDS
+#define CSWBATTERY_HISTORY_TIER0_RECORDS 6
+#endif
+#ifndef CSWBATTERY_HISTORY_TIER1_S
+#define CSWBATTERY_HISTORY_TIER1_S 60
+#endif
+#ifndef CSWBATTERY_HISTORY_TIER1_RECORDS
+#define CSWBATTERY_HISTORY_TIER1_RECORDS 60
+#endif
+#ifndef CSWBATTERY_HISTORY_TIER2_S
+#define CSWBATTERY_HISTORY_TIER2_S 900
+#endif
+#ifndef CSWBATTERY_HISTORY_TIER2_RECORDS
+#define CSWBATTERY_HISTORY_TIER2_RECORDS 96
+#endif
+#define CSWBATTERY_HISTORY_TIERS 3
+
+// 4 bytes per record
+struct batteryHistoryRecord {
+  uint16_t      millivolts;     // average over the period
+  uint8_t       percentage;     // 255 - charging
+  uint8_t       flags;          // CSWBatteryHistory::RECORD_*
+};
+
+/// @brief One resolution of the history. The ticks are averaged into the current period
+/// incrementally; when the period is over the average becomes the record
+class CSWBatteryHistoryTier {
+  public:
+    CSWBatteryHistoryTier(unsigned long period_s, batteryHistoryRecord * records, int capacity)
+      : _period_ms(period_s * 1000), _records(records), _capacity(capacity) {}
+
+    int         size(void) const { return _count; }
+    int         capacity(void) const { return _capacity; }
+    unsigned long getPeriodMs(void) const { return _period_ms; }
+    // 0 is the oldest record, size()-1 - the newest one
+    const batteryHistoryRecord& operator[](int i) const { return _records[(_head + i) % _capacity]; }
+    // millis() of the end of the period of the record
+    unsigned long getTime(int i) const { return _period_start - (unsigned long)(_count - i - 1) * _period_ms; }
+
+    void add(unsigned long tm, long mv, int percentage, bool charging) {
+      if(!_started) {
+        _period_start = tm;
+        _started = true;
+      }
+      unsigned long __elapsed = tm - _period_start;
+      if(__elapsed >= _period_ms * (unsigned long)_capacity) {
+        // nothing of the current records is left after such a long gap (or millis() started over)
+        this->resetPeriod();
+        _count = 0;
+        _period_start = tm;
+      } else {
+        while(tm - _period_start >= _period_ms) {
+          this->close();
+          _period_start += _period_ms;
+        }
+      }
+      _millivolts_sum += mv;
+      if(percentage >= 0) {
+        _percentage_sum += percentage;
+        _percentage_n++;
+      }
+      if(charging) _charging = true;
+      _n++;
+    }
+    void clear(void) {
+      _head = 0;
+      _count = 0;
+      _started = false;
+      this->resetPeriod();
+    }
+  protected:
+    unsigned long _period_ms;
+    batteryHistoryRecord * _records;
+    int         _capacity;
+    int         _head = 0;
+    int         _count = 0;
+    bool        _started = false;
+    unsigned long _period_start = 0;
+    // the current period
+    long        _millivolts_sum = 0;
+    long        _percentage_sum = 0;
+    int         _percentage_n = 0;
+    int         _n = 0;
+    bool        _charging = false;
+
+    void close(void);
+    void resetPeriod(void) {
+      _millivolts_sum = 0;
+      _percentage_sum = 0;
+      _percentage_n = 0;
+      _n = 0;
+      _charging = false;
+    }
+};
+
+/// @brief Tiered history fed by CSWBattery::tick() (see CSWBattery::setBatteryHistory()).
+/// It is written by the sampling task - read it from the handlers, which run in the same task.
+class CSWBatteryHistory {
+  public:
+    static const uint8_t RECORD_CHARGING=0x01;
+    static const uint8_t RECORD_GAP=0x02;       // no ticks during the period
+    static const uint8_t PERCENTAGE_CHARGING=255;
+
+    CSWBatteryHistory()
+      : _tiers{
+          CSWBatteryHistoryTier(CSWBATTERY_HISTORY_TIER0_S, _tier0, CSWBATTERY_HISTORY_TIER0_RECORDS),
+          CSWBatteryHistoryTier(CSWBATTERY_HISTORY_TIER1_S, _tier1, CSWBATTERY_HISTORY_TIER1_RECORDS),
+          CSWBatteryHistoryTier(CSWBATTERY_HISTORY_TIER2_S, _tier2, CSWBATTERY_HISTORY_TIER2_RECORDS)
+        } {}
+
+    void add(unsigned long tm, long mv, int percentage, bool charging) {
+      for(int i=0;i<CSWBATTERY_HISTORY_TIERS;i++) _tiers[i].add(tm, mv, percentage, charging);
+    }
+    void clear(void) {
+      for(int i=0;i<CSWBATTERY_HISTORY_TIERS;i++) _tiers[i].clear();
+    }
+    static int  getTiersCount(void) { return CSWBATTERY_HISTORY_TIERS; }
+    const CSWBatteryHistoryTier& getTier(int tier) const { return _tiers[tier]; }
+
+    /// @brief Goes through the records of one tier from the oldest to the newest:
+    /// for(CSWBatteryHistory::iterator it = h.begin(1); it != h.end(1); ++it) draw(it.getTime(), it->millivolts);
+    class iterator {
+      public:
+        iterator(const CSWBatteryHistoryTier * tier, int i) : _tier(tier), _i(i) {}
+        const batteryHistoryRecord& operator*(void) const { return (*_tier)[_i]; }
+        const batteryHistoryRecord* operator->(void) const { return &(*_tier)[_i]; }
+        iterator&   operator++(void) { _i++; return *this; }
+        bool        operator!=(const iterator& other) const { return _i != other._i; }
+        bool        operator==(const iterator& other) const { return _i == other._i; }
+        unsigned long getTime(void) const { return _tier->getTime(_i); }
+      protected:
+        const CSWBatteryHistoryTier * _tier;
+        int         _i;
+    };
+    iterator    begin(int tier) const { return iterator(&_tiers[tier], 0); }
+    iterator    end(int tier) const { return iterator(&_tiers[tier], _tiers[tier].size()); }
+  protected:
+    batteryHistoryRecord _tier0[CSWBATTERY_HISTORY_TIER0_RECORDS];
+    batteryHistoryRecord _tier1[CSWBATTERY_HISTORY_TIER1_RECORDS];
+    batteryHistoryRecord _tier2[CSWBATTERY_HISTORY_TIER2_RECORDS];
+    CSWBatteryHistoryTier _tiers[CSWBATTERY_HISTORY_TIERS];
+};
+
+inline void CSWBatteryHistoryTier::close(void) {
+  batteryHistoryRecord __record;
+  if(_n == 0) {
+    __record.millivolts = 0;
+    __record.percentage = 0;
+    __record.flags = CSWBatteryHistory::RECORD_GAP;
+  } else {
+    __record.millivolts = (uint16_t)((_millivolts_sum + _n / 2) / _n);
+    __record.percentage = (_percentage_n > 0) ? (uint8_t)((_percentage_sum + _percentage_n / 2) / _percentage_n) : CSWBatteryHistory::PERCENTAGE_CHARGING;
+    __record.flags = _charging ? CSWBatteryHistory::RECORD_CHARGING : 0;
+  }
+  _records[(_head + _count) % _capacity] = __record;
+  if(_count == _capacity) _head = (_head + 1) % _capacity;
+  else _count++;
+  this->resetPeriod();
+}
+#endif
@@ -0,0 +1,121 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryLog.cpp
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Debug logging of the CSWBattery library.
+  *
+  ******************************************************************************
+  */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "CSWBatteryLog.h"
+#include "CSWBatteryHAL.h"
+
+CSWBatteryLog::slot           CSWBatteryLog::_slots[CSWBATTERY_LOG_SLOTS];
+std::atomic<uint32_t>         CSWBatteryLog::_enqueue_pos(0);
+std::atomic<uint32_t>         CSWBatteryLog::_dequeue_pos(0);
+std::atomic<uint32_t>         CSWBatteryLog::_dropped(0);
+std::atomic<bool>             CSWBatteryLog::_drain_task_started(false);
+unsigned long                 CSWBatteryLog::_drain_period_ms = 100;
+
+static const char * CSWBATTERY_LOG_PREFIX = "[CSWBattery] ";
+
+static void CSWBatteryLog_serialSink(const char * message) {
+  CSWBatteryHAL::print(message);
+}
+
+// The queue is the bounded MPMC one: every slot has the sequence number which tells
+// if it is free for the writer (== position) or ready for the reader (== position + 1).
+// The slot index is added to the stored value, so the zero-initialized queue is already valid.
+uint32_t CSWBatteryLog::loadSequence(uint32_t i) {
+  return _slots[i].sequence.load(std::memory_order_acquire) + i;
+}
+void CSWBatteryLog::storeSequence(uint32_t i, uint32_t s) {
+  _slots[i].sequence.store(s - i, std::memory_order_release);
+}
+
+/// @brief Put the message into the queue. Never blocks
+/// @return false if the queue is full and the message was dropped
+bool CSWBatteryLog::write(const char * format, ...) {
+  uint32_t __pos = _enqueue_pos.load(std::memory_order_relaxed);
+  uint32_t __i;
+  for(;;) {
+    __i = __pos % CSWBATTERY_LOG_SLOTS;
+    int32_t __diff = (int32_t)(loadSequence(__i) - __pos);
+    if(__diff == 0) {
+      if(_enqueue_pos.compare_exchange_weak(__pos, __pos + 1, std::memory_order_relaxed)) break;
+    } else if(__diff < 0) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      __pos = _enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+  size_t __prefix_len = strlen(CSWBATTERY_LOG_PREFIX);
+  memcpy(_slots[__i].text, CSWBATTERY_LOG_PREFIX, __prefix_len);
+  va_list __args;
+  va_start(__args, format);
+  vsnprintf(_slots[__i].text + __prefix_len, CSWBATTERY_LOG_MESSAGE_SIZE - __prefix_len, format, __args);
+  va_end(__args);
+  storeSequence(__i, __pos + 1);
+  return true;
+}
+
+/// @brief Print the queued messages
+/// @param sink where to print them (NULL - Serial)
+/// @param max_messages stop after this amount of messages (-1 - drain everything)
+/// @return number of printed messages
+int CSWBatteryLog::drain(CSWBatteryLogSink sink, int max_messages) {
+  if(sink == NULL) sink = CSWBatteryLog_serialSink;
+  int __drained = 0;
+  uint32_t __pos = _dequeue_pos.load(std::memory_order_relaxed);
+  while((max_messages < 0) || (__drained < max_messages)) {
+    uint32_t __i = __pos % CSWBATTERY_LOG_SLOTS;
+    int32_t __diff = (int32_t)(loadSequence(__i) - (__pos + 1));
+    if(__diff == 0) {
+      if(!_dequeue_pos.compare_exchange_weak(__pos, __pos + 1, std::memory_order_relaxed)) continue;
+      sink(_slots[__i].text);
+      storeSequence(__i, __pos + CSWBATTERY_LOG_SLOTS);
+      __pos++;
+      __drained++;
+    } else if(__diff < 0) {
+      break; // empty
+    } else {
+      __pos = _dequeue_pos.load(std::memory_order_relaxed);
+    }
+  }
+  return __drained;
+}
+
+/// @brief Start the low-priority task which prints the queued messages to Serial
+void CSWBatteryLog::startDrainTask(unsigned long period_ms, int priority) {
+  if(_drain_task_started.exchange(true)) return;
+  unsigned long __min_t = MIN_DRAIN_PERIOD_MS;
+  _drain_period_ms = max(period_ms, __min_t);
+  CSWBatteryHAL::createTask(
+    CSWBatteryLog_task,   // Function that should be called
+    "CSWBattery Log",     // Name of the task (for debugging)
+    2048,                 // Stack size (bytes)
+    NULL,                 // Parameter to pass
+    priority              // Task priority
+  );
+}
+
+bool CSWBatteryLog::checkIfDrainTaskStarted(void) {
+  return _drain_task_started.load();
+}
+
+uint32_t CSWBatteryLog::getDroppedCount(void) {
+  return _dropped.load(std::memory_order_relaxed);
+}
+
+void CSWBatteryLog_task(void * c) {
+  (void)c;
+  for(;;) {
+    CSWBatteryLog::drain();
+    CSWBatteryHAL::delayMs(CSWBatteryLog::_drain_period_ms);
+  }
+}
@@ -0,0 +1,69 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryLog.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Debug logging of the CSWBattery library. Messages are formatted into
+  *          a lock-free queue and printed later by drain(), so logging never
+  *          waits for the UART.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryLog_h
+#define CSWBatteryLog_h
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Messages with the level above this one are not compiled at all.
+// Build with -DCSWBATTERY_LOG_LEVEL=-1 to strip every debug message from the library.
+#ifndef CSWBATTERY_LOG_LEVEL
+#define CSWBATTERY_LOG_LEVEL 99
+#endif
+// Number of the messages waiting for the drain (power of two) - the newer ones are dropped when it is full
+#ifndef CSWBATTERY_LOG_SLOTS
+#define CSWBATTERY_LOG_SLOTS 16
+#endif
+static_assert((CSWBATTERY_LOG_SLOTS & (CSWBATTERY_LOG_SLOTS - 1)) == 0, "CSWBATTERY_LOG_SLOTS has to be the power of two");
+#ifndef CSWBATTERY_LOG_MESSAGE_SIZE
+#define CSWBATTERY_LOG_MESSAGE_SIZE 112
+#endif
+
+// To be used inside of the CSWBattery methods - the runtime DEBUG/DEBUG_LEVEL settings still apply.
+// Level 0 messages are shown whenever the debug is on.
+#define CSWB_LOG(level, ...) do { \
+    if(((level) <= CSWBATTERY_LOG_LEVEL) && DEBUG && (((level) <= 0) || (DEBUG_LEVEL >= (level)))) \
+      CSWBatteryLog::write(__VA_ARGS__); \
+  } while(0)
+
+typedef void (*CSWBatteryLogSink) (const char * message);
+
+void CSWBatteryLog_task(void * c);
+
+class CSWBatteryLog {
+  public:
+    static bool     write(const char * format, ...) __attribute__((format(printf, 1, 2)));
+    static int      drain(CSWBatteryLogSink sink=NULL, int max_messages=-1);
+    static void     startDrainTask(unsigned long period_ms=100, int priority=0);
+    static bool     checkIfDrainTaskStarted(void);
+    static uint32_t getDroppedCount(void);
+
+    static const unsigned long MIN_DRAIN_PERIOD_MS=10;
+  protected:
+    struct slot {
+      std::atomic<uint32_t> sequence;
+      char                  text[CSWBATTERY_LOG_MESSAGE_SIZE];
+    };
+    static slot                   _slots[CSWBATTERY_LOG_SLOTS];
+    static std::atomic<uint32_t>  _enqueue_pos;
+    static std::atomic<uint32_t>  _dequeue_pos;
+    static std::atomic<uint32_t>  _dropped;
+    static std::atomic<bool>      _drain_task_started;
+    static unsigned long          _drain_period_ms;
+
+    static uint32_t loadSequence(uint32_t i);
+    static void     storeSequence(uint32_t i, uint32_t s);
+    friend void     CSWBatteryLog_task(void * c);
+};
+#endif
@@ -0,0 +1,197 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryManager.cpp
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   One sampling task for several batteries.
+  *
+  ******************************************************************************
+  */
+#include "CSWBattery.h"
+#include "CSWBatteryManager.h"
+#include "CSWBatteryHAL.h"
+
+/// @brief Stop the task and unregister the batteries - the ones which were collecting data go on with their own tasks
+CSWBatteryManager::~CSWBatteryManager() {
+  this->stop();
+  for(int i=0;i<CSWBATTERY_MANAGER_MAX_CHANNELS;i++) {
+    CSWBattery * __battery = _channels[i].load();
+    if(__battery != NULL) this->removeBattery(__battery);
+  }
+}
+
+/// @brief Register the battery. If it is collecting data with its own task,
+/// that task is stopped and the manager goes on instead
+/// @return false if there is no free channel or it is registered already
+bool CSWBatteryManager::addBattery(CSWBattery * b) {
+  if((b == NULL) || (b->_manager != NULL)) return false;
+  int __free = -1;
+  for(int i=0;i<CSWBATTERY_MANAGER_MAX_CHANNELS;i++) {
+    if(_channels[i].load() == NULL) { __free = i; break; }
+  }
+  if(__free == -1) return false;
+  bool __collecting = b->checkIfCollectingData();
+  if(__collecting) b->stopCollectingData();
+  b->_manager = this;
+  _channels[__free].store(b);
+  if(__collecting) b->startCollectingData();
+  else this->reschedule();
+  return true;
+}
+
+/// @brief Unregister the battery; if it was collecting data it goes on with its own task.
+/// When called from the other task, returns after its tick in progress is over
+bool CSWBatteryManager::removeBattery(CSWBattery * b) {
+  for(int i=0;i<CSWBATTERY_MANAGER_MAX_CHANNELS;i++) {
+    if(_channels[i].load() != b) continue;
+    _channels[i].store(NULL);
+    this->reschedule();
+    if(CSWBatteryHAL::getCurrentTask() != _task.load()) {
+      while(_ticking_channel.load() == i) CSWBatteryHAL::delayMs(1);
+    }
+    b->_manager = NULL;
+    if(b->checkIfCollectingData()) {
+      b->_collecting_data_started = false;
+      b->startCollectingData();
+    }
+    return true;
+  }
+  return false;
+}
+
+int CSWBatteryManager::getBatteriesCount(void) {
+  int __count = 0;
+  for(int i=0;i<CSWBATTERY_MANAGER_MAX_CHANNELS;i++) if(_channels[i].load() != NULL) __count++;
+  return __count;
+}
+
+CSWBattery * CSWBatteryManager::getBattery(int channel) {
+  if((channel < 0) || (channel >= CSWBATTERY_MANAGER_MAX_CHANNELS)) return NULL;
+  return _channels[channel].load();
+}
+
+void CSWBatteryManager::start(int priority) {
+  if(_task.load() != NULL) return;
+  void * __task = CSWBatteryHAL::createTask(
+    CSWBatteryManager_task, // Function that should be called
+    "CSWBattery Manager",   // Name of the task (for debugging)
+    CSWBATTERY_MANAGER_STACK_SIZE, // Stack size (bytes)
+    this,                   // Parameter to pass
+    priority                // Task priority
+  );
+  // the task waits for its handle to be stored, so its NULL on exit is never overwritten
+  _task.store(__task);
+  if(__task != NULL) _task_ready.give();
+}
+
+/// @brief Stop the task right away. When called from the other task, returns after the last tick is over
+void CSWBatteryManager::stop(void) {
+  void * __task = _task.load();
+  if((__task == NULL) || (__task == CSWBatteryHAL::getCurrentTask())) return;
+  this->notify(CSWBattery::NOTIFY_STOP);
+  while(_task.load() != NULL) CSWBatteryHAL::delayMs(1);
+}
+
+bool CSWBatteryManager::checkIfStarted(void) {
+  return _task.load() != NULL;
+}
+
+/// @brief Let the task pick up the batteries which started or stopped collecting data or want the refresh
+void CSWBatteryManager::reschedule(void) {
+  this->notify(CSWBattery::NOTIFY_RESCHEDULE);
+}
+
+void CSWBatteryManager::notify(uint32_t bits) {
+  void * __task = _task.load();
+  if(__task != NULL) CSWBatteryHAL::notifyTask(__task, bits);
+}
+
+bool CSWBatteryManager::checkIfDueEarlier(int a, int b) {
+  // millis() wraps around - compare the difference
+  return (long)(_due_ms[a] - _due_ms[b]) < 0;
+}
+
+void CSWBatteryManager::heapPush(int channel) {
+  int i = _heap_size++;
+  _heap[i] = channel;
+  while(i > 0) {
+    int __parent = (i - 1) / 2;
+    if(!this->checkIfDueEarlier(_heap[i], _heap[__parent])) break;
+    uint8_t __t = _heap[i]; _heap[i] = _heap[__parent]; _heap[__parent] = __t;
+    i = __parent;
+  }
+}
+
+int CSWBatteryManager::heapPop(void) {
+  int __top = _heap[0];
+  _heap[0] = _heap[--_heap_size];
+  int i = 0;
+  for(;;) {
+    int __l = 2 * i + 1;
+    int __r = __l + 1;
+    int __min = i;
+    if((__l < _heap_size) && this->checkIfDueEarlier(_heap[__l], _heap[__min])) __min = __l;
+    if((__r < _heap_size) && this->checkIfDueEarlier(_heap[__r], _heap[__min])) __min = __r;
+    if(__min == i) break;
+    uint8_t __t = _heap[i]; _heap[i] = _heap[__min]; _heap[__min] = __t;
+    i = __min;
+  }
+  return __top;
+}
+
+/// @brief Heap of the collecting batteries; the ones which just started are due right away
+void CSWBatteryManager::rebuildSchedule(unsigned long now) {
+  _heap_size = 0;
+  for(int i=0;i<CSWBATTERY_MANAGER_MAX_CHANNELS;i++) {
+    CSWBattery * __battery = _channels[i].load();
+    if((__battery == NULL) || (!__battery->checkIfCollectingData())) {
+      _scheduled[i] = false;
+      continue;
+    }
+    if((!_scheduled[i]) || __battery->_refresh_requested.load()) _due_ms[i] = now;
+    _scheduled[i] = true;
+    this->heapPush(i);
+  }
+}
+
+/// @brief Tick the batteries which are due
+/// @return milliseconds till the next deadline, CSWBatteryHAL::WAIT_FOREVER if there is none
+unsigned long CSWBatteryManager::serviceDue(unsigned long now) {
+  while((_heap_size > 0) && ((long)(_due_ms[_heap[0]] - now) <= 0)) {
+    int __channel = this->heapPop();
+    _ticking_channel.store(__channel);
+    CSWBattery * __battery = _channels[__channel].load();
+    if((__battery == NULL) || (!__battery->checkIfCollectingData())) {
+      _scheduled[__channel] = false;
+      _ticking_channel.store(-1);
+      continue;
+    }
+    __battery->tick();
+#if CSWBATTERY_STATS
+    __battery->_stats.setStackHighWater(CSWBatteryHAL::getStackHighWater());
+#endif
+    _ticking_channel.store(-1);
+    unsigned long __min_t = CSWBattery::MIN_TASK_DELAY_S;
+    // counted from the end of the tick, as the own task does - the ticks of the other batteries
+    // may have taken a while, and the checks can't come closer than the interval
+    _due_ms[__channel] = CSWBatteryHAL::getMillis() + max(__battery->getTimeRecheckS(), __min_t) * 1000;
+    this->heapPush(__channel);
+  }
+  if(_heap_size == 0) return CSWBatteryHAL::WAIT_FOREVER;
+  return _due_ms[_heap[0]] - now;
+}
+
+void CSWBatteryManager_task(void * c) {
+  CSWBatteryManager * __manager = static_cast<CSWBatteryManager *>(c);
+  __manager->_task_ready.take(CSWBatteryHAL::WAIT_FOREVER);
+  __manager->rebuildSchedule(CSWBatteryHAL::getMillis());
+  for(;;) {
+    unsigned long __wait_ms = __manager->serviceDue(CSWBatteryHAL::getMillis());
+    uint32_t __bits = CSWBatteryHAL::waitForNotification(__wait_ms);
+    if(__bits & CSWBattery::NOTIFY_STOP) break;
+    if(__bits & (CSWBattery::NOTIFY_RESCHEDULE | CSWBattery::NOTIFY_REFRESH)) __manager->rebuildSchedule(CSWBatteryHAL::getMillis());
+  }
+  __manager->_task.store(NULL);
+  CSWBatteryHAL::deleteCurrentTask();
+}
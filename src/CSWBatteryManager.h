@@ -0,0 +1,63 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryManager.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   One sampling task for several batteries (main cell, backup cell,
+  *          external pack...) instead of the task per battery.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryManager_h
+#define CSWBatteryManager_h
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "CSWBatterySignal.h"
+
+#ifndef CSWBATTERY_MANAGER_MAX_CHANNELS
+#define CSWBATTERY_MANAGER_MAX_CHANNELS 4
+#endif
+#ifndef CSWBATTERY_MANAGER_STACK_SIZE
+#define CSWBATTERY_MANAGER_STACK_SIZE 4096
+#endif
+
+class CSWBattery;
+
+void CSWBatteryManager_task(void * c);
+
+/// @brief Services the registered batteries from one task. The next tick of every
+/// battery is kept in the min-heap of the deadlines, so the task sleeps exactly till
+/// the closest one. The batteries have to outlive their registration.
+class CSWBatteryManager {
+  public:
+    ~CSWBatteryManager();
+    bool        addBattery(CSWBattery * b);
+    bool        removeBattery(CSWBattery * b);
+    int         getBatteriesCount(void);
+    CSWBattery * getBattery(int channel);
+    void        start(int priority=1);
+    void        stop(void);
+    bool        checkIfStarted(void);
+    void        reschedule(void);
+  protected:
+    std::atomic<CSWBattery *> _channels[CSWBATTERY_MANAGER_MAX_CHANNELS] {};
+    // owned by the task
+    unsigned long _due_ms[CSWBATTERY_MANAGER_MAX_CHANNELS] = {};
+    bool        _scheduled[CSWBATTERY_MANAGER_MAX_CHANNELS] = {};
+    uint8_t     _heap[CSWBATTERY_MANAGER_MAX_CHANNELS] = {};
+    int         _heap_size=0;
+    std::atomic<int> _ticking_channel{-1};
+    std::atomic<void *> _task{NULL};  // TaskHandle_t
+    CSWBatterySignal _task_ready;     // given once _task is stored - the task starts with it
+
+    bool        checkIfDueEarlier(int a, int b);
+    void        heapPush(int channel);
+    int         heapPop(void);
+    void        rebuildSchedule(unsigned long now);
+    unsigned long serviceDue(unsigned long now);
+    void        notify(uint32_t bits);
+    friend void CSWBatteryManager_task(void * c);
+};
+#endif
@@ -0,0 +1,83 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryProfile.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Board and chemistry profiles: the ADC, the voltage divider and the
+  *          thresholds of the pack, fixed at compile time.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryProfile_h
+#define CSWBatteryProfile_h
+#include <stdint.h>
+
+/// @brief The profile as the battery sees it (getProfile()). Made of the traits by
+/// CSWBatteryProfileOf - one constant in the flash per profile. The hot paths of the
+/// battery use the traits themselves, so their constants are folded at compile time
+struct batteryProfile {
+  uint8_t       adc_bits;       // resolution of the ADC
+  uint16_t      vref_mv;        // full scale of the ADC
+  float         divider;        // battery voltage / voltage on the pin
+  uint8_t       cells;          // in series; the discharge curve is the one of a single cell
+  float         full_v;         // voltages of the whole pack; full - the target of the charge as well
+  float         empty_v;
+  float         charging_v;     // seen only when the charger is attached
+  float         default_cf;     // battery coefficient before the calibration
+};
+
+// ESP32: 12 bits ADC, 3.3V, 1:2 divider, single LiPo cell
+struct CSWBatteryProfileESP32 {
+  static constexpr uint8_t  ADC_BITS=12;
+  static constexpr uint16_t VREF_MV=3300;
+  static constexpr float    DIVIDER=2.0f;
+  static constexpr uint8_t  CELLS=1;
+  static constexpr float    FULL_V=4.2f;
+  static constexpr float    EMPTY_V=3.7f;
+  static constexpr float    CHARGING_V=4.3f;
+  static constexpr float    DEFAULT_CF=1.1f;
+};
+
+// ESP32-S3: 13 bits ADC
+struct CSWBatteryProfileESP32S3 : CSWBatteryProfileESP32 {
+  static constexpr uint8_t  ADC_BITS=13;
+};
+
+// two LiPo cells in series behind the 1:4 divider
+struct CSWBatteryProfile2S : CSWBatteryProfileESP32 {
+  static constexpr float    DIVIDER=4.0f;
+  static constexpr uint8_t  CELLS=2;
+  static constexpr float    FULL_V=8.4f;
+  static constexpr float    EMPTY_V=7.4f;
+  static constexpr float    CHARGING_V=8.6f;
+};
+
+// Profile of CSWBattery itself; CSWBatteryT<profile> for the others
+#ifndef CSWBATTERY_PROFILE
+#define CSWBATTERY_PROFILE CSWBatteryProfileESP32
+#endif
+
+template<class P> struct CSWBatteryProfileOf {
+  static_assert((P::ADC_BITS >= 8) && (P::ADC_BITS <= 16), "The ADC has to have 8 to 16 bits.");
+  static_assert((P::CELLS >= 1) && (P::DIVIDER >= 1), "Wrong cells or divider of the profile.");
+  static_assert((P::EMPTY_V < P::FULL_V) && (P::FULL_V < P::CHARGING_V), "Voltages of the profile have to be empty < full < charging.");
+  // the largest reading has to fit the 16.16 fixed point of the millivolts
+  static_assert(P::DEFAULT_CF * P::DIVIDER * P::VREF_MV < 65535, "Full scale of the profile is above 65.5V.");
+  static constexpr batteryProfile profile = {P::ADC_BITS, P::VREF_MV, P::DIVIDER, P::CELLS, P::FULL_V, P::EMPTY_V, P::CHARGING_V, P::DEFAULT_CF};
+  static constexpr uint32_t MAX_RAW = (1UL << P::ADC_BITS) - 1;
+  // 16.16 fixed point factor which turns the ADC reading into millivolts at the coefficient
+  static constexpr uint32_t getMillivoltsScale(float cf) { return (uint32_t)((double)cf * P::DIVIDER * P::VREF_MV / MAX_RAW * 65536 + 0.5); }
+  static constexpr uint32_t DEFAULT_SCALE = (uint32_t)((double)P::DEFAULT_CF * P::DIVIDER * P::VREF_MV / ((1UL << P::ADC_BITS) - 1) * 65536 + 0.5);
+  // the millivolts table is built with the 32 bits math; the other coefficients are converted with the 64 bits one
+  static_assert((uint64_t)MAX_RAW * DEFAULT_SCALE + 32768 <= 0xFFFFFFFFULL, "The largest reading of the profile overflows the millivolts scale.");
+  // range of a single cell - the default discharge curve is stretched over it
+  static constexpr long EMPTY_CELL_MV = (long)((double)P::EMPTY_V * 1000 / P::CELLS + 0.5);
+  static constexpr long FULL_CELL_MV = (long)((double)P::FULL_V * 1000 / P::CELLS + 0.5);
+};
+template<class P> constexpr batteryProfile CSWBatteryProfileOf<P>::profile;
+template<class P> constexpr uint32_t CSWBatteryProfileOf<P>::MAX_RAW;
+template<class P> constexpr uint32_t CSWBatteryProfileOf<P>::DEFAULT_SCALE;
+template<class P> constexpr long CSWBatteryProfileOf<P>::EMPTY_CELL_MV;
+template<class P> constexpr long CSWBatteryProfileOf<P>::FULL_CELL_MV;
+#endif
@@ -0,0 +1,107 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryRingBuffer.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Fixed-capacity ring buffers used by CSWBattery instead of the heap
+  *          allocated containers.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryRingBuffer_h
+#define CSWBatteryRingBuffer_h
+#include <stdint.h>
+
+/// @brief FIFO with the capacity known at compile time. Pushing into the full
+/// buffer evicts the oldest element, nothing is ever allocated.
+template<typename T, int N>
+class CSWBatteryRingBuffer {
+  public:
+    int         size(void) const { return _count; }
+    bool        empty(void) const { return _count == 0; }
+    bool        full(void) const { return _count == N; }
+    static int  capacity(void) { return N; }
+
+    // 0 is the oldest element, size()-1 - the newest one
+    T&          operator[](int i) { return _items[_pos(i)]; }
+    const T&    operator[](int i) const { return _items[_pos(i)]; }
+    T&          front(void) { return _items[_head]; }
+    const T&    front(void) const { return _items[_head]; }
+    T&          back(void) { return _items[_pos(_count - 1)]; }
+    const T&    back(void) const { return _items[_pos(_count - 1)]; }
+
+    void push_back(const T& item) {
+      if(_count == N) pop_front();
+      _items[_pos(_count)] = item;
+      _count++;
+    }
+    void pop_front(void) {
+      if(_count == 0) return;
+      _head = (_head + 1) % N;
+      _count--;
+    }
+    void clear(void) {
+      _head = 0;
+      _count = 0;
+    }
+  protected:
+    int _pos(int i) const { return (_head + i) % N; }
+
+    T           _items[N];
+    int         _head = 0;
+    int         _count = 0;
+};
+
+/// @brief Ring buffer of the battery checks which keeps the running sum, min and max
+/// of the millivolts, so the statistics of the window never need a rescan.
+/// Min and max are kept with the monotonic queues of the buffer positions - amortized O(1).
+template<typename T, int N>
+class CSWBatteryChecksBuffer : public CSWBatteryRingBuffer<T, N> {
+  typedef CSWBatteryRingBuffer<T, N> base;
+  public:
+    void push_back(const T& item) {
+      if(this->_count == N) pop_front();
+      int __pos = this->_pos(this->_count);
+      base::push_back(item);
+      _millivolts_sum += item.millivolts;
+      while((_min_q.count > 0) && (this->_items[_min_q.back()].millivolts >= item.millivolts)) _min_q.count--;
+      _min_q.push(__pos);
+      while((_max_q.count > 0) && (this->_items[_max_q.back()].millivolts <= item.millivolts)) _max_q.count--;
+      _max_q.push(__pos);
+    }
+    void pop_front(void) {
+      if(this->_count == 0) return;
+      int __pos = this->_head;
+      _millivolts_sum -= this->_items[__pos].millivolts;
+      if((_min_q.count > 0) && (_min_q.front() == __pos)) _min_q.pop();
+      if((_max_q.count > 0) && (_max_q.front() == __pos)) _max_q.pop();
+      base::pop_front();
+    }
+    void clear(void) {
+      base::clear();
+      _millivolts_sum = 0;
+      _min_q.clear();
+      _max_q.clear();
+    }
+
+    long        getMillivoltsSum(void) const { return _millivolts_sum; }
+    long        getAverageMillivolts(void) const { return (this->_count > 0) ? (_millivolts_sum + this->_count / 2) / this->_count : -1; }
+    long        getMinMillivolts(void) const { return (this->_count > 0) ? this->_items[_min_q.front()].millivolts : -1; }
+    long        getMaxMillivolts(void) const { return (this->_count > 0) ? this->_items[_max_q.front()].millivolts : -1; }
+  protected:
+    struct positionsQueue {
+      int pos[N];
+      int head = 0;
+      int count = 0;
+      int  front(void) const { return pos[head]; }
+      int  back(void) const { return pos[(head + count - 1) % N]; }
+      void push(int p) { pos[(head + count) % N] = p; count++; }
+      void pop(void) { head = (head + 1) % N; count--; }
+      void clear(void) { head = 0; count = 0; }
+    };
+    long            _millivolts_sum = 0;
+    positionsQueue  _min_q;
+    positionsQueue  _max_q;
+};
+#endif
@@ -0,0 +1,27 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatterySignal.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Binary signal to wait for with the timeout: the FreeRTOS binary
+  *          semaphore on the board, the simulated one on the host (see CSWBatteryHAL.h).
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatterySignal_h
+#define CSWBatterySignal_h
+#include <stdint.h>
+#include "CSWBatteryHAL.h"
+
+class CSWBatterySignal {
+  public:
+    CSWBatterySignal() : _semaphore(CSWBatteryHAL::createSemaphore()) {}
+    ~CSWBatterySignal() { CSWBatteryHAL::deleteSemaphore(_semaphore); }
+    void give(void) { CSWBatteryHAL::giveSemaphore(_semaphore); }
+    // false on timeout
+    bool take(unsigned long timeout_ms) { return CSWBatteryHAL::takeSemaphore(_semaphore, timeout_ms); }
+  protected:
+    CSWBatteryHAL::semaphore_t _semaphore;
+};
+#endif
@@ -0,0 +1,74 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatterySnapshot.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Snapshot of the battery state published by the sampling task and
+  *          read without locks from any core.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatterySnapshot_h
+#define CSWBatterySnapshot_h
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+struct BatterySnapshot {
+  float         voltage=-1;
+  int           percentage=-1;
+  int           section=-1;
+  bool          charging=false;
+  bool          low=false;
+  bool          empty=false;
+  unsigned long timestamp=0;    // millis() of the tick which produced it; 0 - nothing was published yet
+  int           sample_count=0; // number of checks in the collected data window
+  long          minutes_to_empty=-1; // -1 - unknown or charging
+  long          minutes_to_full=-1;  // -1 - unknown or discharging
+  float         estimate_confidence=0;
+};
+
+/// @brief Sequence lock for the single writer. The writer never waits, the readers retry
+/// while the writer is in the middle of the update. The data is copied word by word
+/// through the atomics, so there is no data race even while the reader retries.
+template<typename T>
+class CSWBatterySeqLock {
+  public:
+    CSWBatterySeqLock() {
+      T __empty;
+      this->write(__empty);
+    }
+    void write(const T& value) {
+      uint32_t __words[WORDS];
+      memset(__words, 0, sizeof(__words));
+      memcpy(__words, &value, sizeof(T));
+      uint32_t __seq = _sequence.load(std::memory_order_relaxed);
+      _sequence.store(__seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      for(int i=0;i<WORDS;i++) _data[i].store(__words[i], std::memory_order_relaxed);
+      _sequence.store(__seq + 2, std::memory_order_release);
+    }
+    T read(void) const {
+      uint32_t __words[WORDS];
+      uint32_t __seq1, __seq2;
+      do {
+        __seq1 = _sequence.load(std::memory_order_acquire);
+        for(int i=0;i<WORDS;i++) __words[i] = _data[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        __seq2 = _sequence.load(std::memory_order_relaxed);
+      } while((__seq1 & 1) || (__seq1 != __seq2));
+      T __value;
+      memcpy(&__value, __words, sizeof(T));
+      return __value;
+    }
+    // Even number which grows on every write - tells the reader if there is anything new
+    uint32_t getSequence(void) const {
+      return _sequence.load(std::memory_order_acquire) & ~1UL;
+    }
+  protected:
+    static const int WORDS = (sizeof(T) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+    std::atomic<uint32_t> _sequence{0};
+    std::atomic<uint32_t> _data[WORDS];
+};
+#endif
@@ -0,0 +1,135 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryStats.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Instrumentation counters of the battery handling: ADC reads, tick
+  *          durations, delays, handlers, buffer and the sampling task stack.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryStats_h
+#define CSWBatteryStats_h
+#include <stdint.h>
+#include <atomic>
+
+// Build with -DCSWBATTERY_STATS=0 to compile all the counters out
+#ifndef CSWBATTERY_STATS
+#define CSWBATTERY_STATS 1
+#endif
+// Bucket i of the tick durations histogram counts the ticks of 2^i..2^(i+1)-1 us, the last one - all the longer ones
+#ifndef CSWBATTERY_STATS_BUCKETS
+#define CSWBATTERY_STATS_BUCKETS 20
+#endif
+
+// To be used inside of the CSWBattery methods: CSWB_STAT(addAnalogReads(1))
+#if CSWBATTERY_STATS
+#define CSWB_STAT(call) do { _stats.call; } while(0)
+#else
+#define CSWB_STAT(call) do { } while(0)
+#endif
+
+struct batteryStats {
+  uint32_t      analog_reads=0;
+  uint32_t      ticks=0;
+  uint32_t      tick_us_histogram[CSWBATTERY_STATS_BUCKETS]={};
+  uint32_t      tick_us_max=0;
+  uint32_t      delay_ms=0;             // total time spent in delay()
+  uint32_t      handler_calls=0;
+  uint32_t      handler_us=0;           // total time spent in the handlers
+  uint32_t      handler_us_max=0;
+  uint32_t      buffer_occupancy=0;     // checks in the collected data window after the last tick
+  uint32_t      buffer_occupancy_max=0;
+  uint32_t      flushes=0;
+  uint32_t      fluke_rejections=0;     // changes not accepted by checkBatteryVoltageChanged()
+  uint32_t      burst_rejected_samples=0;
+  uint32_t      read_failures=0;        // readings of the gauge which didn't answer
+  uint32_t      skipped_ticks=0;        // ticks without any reading - nothing was collected
+  uint32_t      stack_high_water=0;     // least free stack of the sampling task; 0 - not known yet
+};
+
+/// @brief The counters behind batteryStats. Relaxed atomics - one instruction each,
+/// whichever task reads the ADC.
+class CSWBatteryStatsCounters {
+  public:
+    void addAnalogReads(uint32_t n) { _analog_reads.fetch_add(n, std::memory_order_relaxed); }
+    void addDelay(uint32_t ms) { _delay_ms.fetch_add(ms, std::memory_order_relaxed); }
+    void addFlush(void) { _flushes.fetch_add(1, std::memory_order_relaxed); }
+    void addFluke(void) { _fluke_rejections.fetch_add(1, std::memory_order_relaxed); }
+    void addBurstRejected(uint32_t n) { _burst_rejected_samples.fetch_add(n, std::memory_order_relaxed); }
+    void addReadFailure(void) { _read_failures.fetch_add(1, std::memory_order_relaxed); }
+    void addSkippedTick(void) { _skipped_ticks.fetch_add(1, std::memory_order_relaxed); }
+    void addTick(uint32_t us) {
+      _ticks.fetch_add(1, std::memory_order_relaxed);
+      int __bucket = 0;
+      while((__bucket < CSWBATTERY_STATS_BUCKETS - 1) && (us >> (__bucket + 1))) __bucket++;
+      _tick_us_histogram[__bucket].fetch_add(1, std::memory_order_relaxed);
+      storeMax(_tick_us_max, us);
+    }
+    void addHandler(uint32_t us) {
+      _handler_calls.fetch_add(1, std::memory_order_relaxed);
+      _handler_us.fetch_add(us, std::memory_order_relaxed);
+      storeMax(_handler_us_max, us);
+    }
+    void setOccupancy(uint32_t n) {
+      _buffer_occupancy.store(n, std::memory_order_relaxed);
+      storeMax(_buffer_occupancy_max, n);
+    }
+    void setStackHighWater(uint32_t free_bytes) {
+      uint32_t __old = _stack_high_water.load(std::memory_order_relaxed);
+      if((__old == 0) || (free_bytes < __old)) _stack_high_water.store(free_bytes, std::memory_order_relaxed);
+    }
+
+    batteryStats get(void) const {
+      batteryStats __s;
+      __s.analog_reads = _analog_reads.load(std::memory_order_relaxed);
+      __s.ticks = _ticks.load(std::memory_order_relaxed);
+      for(int i=0;i<CSWBATTERY_STATS_BUCKETS;i++) __s.tick_us_histogram[i] = _tick_us_histogram[i].load(std::memory_order_relaxed);
+      __s.tick_us_max = _tick_us_max.load(std::memory_order_relaxed);
+      __s.delay_ms = _delay_ms.load(std::memory_order_relaxed);
+      __s.handler_calls = _handler_calls.load(std::memory_order_relaxed);
+      __s.handler_us = _handler_us.load(std::memory_order_relaxed);
+      __s.handler_us_max = _handler_us_max.load(std::memory_order_relaxed);
+      __s.buffer_occupancy = _buffer_occupancy.load(std::memory_order_relaxed);
+      __s.buffer_occupancy_max = _buffer_occupancy_max.load(std::memory_order_relaxed);
+      __s.flushes = _flushes.load(std::memory_order_relaxed);
+      __s.fluke_rejections = _fluke_rejections.load(std::memory_order_relaxed);
+      __s.burst_rejected_samples = _burst_rejected_samples.load(std::memory_order_relaxed);
+      __s.read_failures = _read_failures.load(std::memory_order_relaxed);
+      __s.skipped_ticks = _skipped_ticks.load(std::memory_order_relaxed);
+      __s.stack_high_water = _stack_high_water.load(std::memory_order_relaxed);
+      return __s;
+    }
+    void reset(void) {
+      _analog_reads = 0; _ticks = 0; _tick_us_max = 0; _delay_ms = 0;
+      for(int i=0;i<CSWBATTERY_STATS_BUCKETS;i++) _tick_us_histogram[i] = 0;
+      _handler_calls = 0; _handler_us = 0; _handler_us_max = 0;
+      _buffer_occupancy = 0; _buffer_occupancy_max = 0; _flushes = 0;
+      _fluke_rejections = 0; _burst_rejected_samples = 0; _stack_high_water = 0;
+      _read_failures = 0; _skipped_ticks = 0;
+    }
+  protected:
+    static void storeMax(std::atomic<uint32_t>& m, uint32_t v) {
+      // the calibration and the measurement call their handlers from the task of the user, not the sampling one
+      uint32_t __current = m.load(std::memory_order_relaxed);
+      while((v > __current) && (!m.compare_exchange_weak(__current, v, std::memory_order_relaxed))) {}
+    }
+    std::atomic<uint32_t> _analog_reads{0};
+    std::atomic<uint32_t> _ticks{0};
+    std::atomic<uint32_t> _tick_us_histogram[CSWBATTERY_STATS_BUCKETS] {};
+    std::atomic<uint32_t> _tick_us_max{0};
+    std::atomic<uint32_t> _delay_ms{0};
+    std::atomic<uint32_t> _handler_calls{0};
+    std::atomic<uint32_t> _handler_us{0};
+    std::atomic<uint32_t> _handler_us_max{0};
+    std::atomic<uint32_t> _buffer_occupancy{0};
+    std::atomic<uint32_t> _buffer_occupancy_max{0};
+    std::atomic<uint32_t> _flushes{0};
+    std::atomic<uint32_t> _fluke_rejections{0};
+    std::atomic<uint32_t> _burst_rejected_samples{0};
+    std::atomic<uint32_t> _read_failures{0};
+    std::atomic<uint32_t> _skipped_ticks{0};
+    std::atomic<uint32_t> _stack_high_water{0};
+};
+#endif
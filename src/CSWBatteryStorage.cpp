@@ -0,0 +1,58 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryStorage.cpp
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Persistent storage backends.
+  *
+  ******************************************************************************
+  */
+#include "CSWBatteryStorage.h"
+
+#if defined(ESP32)
+#include <Preferences.h>
+
+bool CSWBatteryNVSStorage::write(const char * key, const void * data, size_t len) {
+  Preferences __prefs;
+  if(!__prefs.begin(_namespace, false)) return false;
+  size_t __written = __prefs.putBytes(key, data, len);
+  __prefs.end();
+  return __written == len;
+}
+
+size_t CSWBatteryNVSStorage::read(const char * key, void * data, size_t len) {
+  Preferences __prefs;
+  if(!__prefs.begin(_namespace, true)) return 0;
+  size_t __read = __prefs.isKey(key) ? __prefs.getBytes(key, data, len) : 0;
+  __prefs.end();
+  return __read;
+}
+#endif
+
+#if !defined(ARDUINO)
+#include <stdio.h>
+
+static void CSWBatteryFileStorage_path(char * path, size_t path_len, const char * dir, const char * key) {
+  snprintf(path, path_len, "%s/%s.bin", dir, key);
+}
+
+bool CSWBatteryFileStorage::write(const char * key, const void * data, size_t len) {
+  char __path[256];
+  CSWBatteryFileStorage_path(__path, sizeof(__path), _dir, key);
+  FILE * __f = fopen(__path, "wb");
+  if(__f == NULL) return false;
+  size_t __written = fwrite(data, 1, len, __f);
+  return (fclose(__f) == 0) && (__written == len);
+}
+
+size_t CSWBatteryFileStorage::read(const char * key, void * data, size_t len) {
+  char __path[256];
+  CSWBatteryFileStorage_path(__path, sizeof(__path), _dir, key);
+  FILE * __f = fopen(__path, "rb");
+  if(__f == NULL) return 0;
+  size_t __read = fread(data, 1, len, __f);
+  fclose(__f);
+  return __read;
+}
+#endif
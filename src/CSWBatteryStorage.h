@@ -0,0 +1,49 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryStorage.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Persistent storage backends for the data which has to survive the
+  *          reboot (e.g. the calibration results).
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryStorage_h
+#define CSWBatteryStorage_h
+#include <stdint.h>
+#include <stddef.h>
+
+/// @brief Key-value storage of the binary records. Keys are up to 15 characters (NVS limit)
+class CSWBatteryStorage {
+  public:
+    virtual ~CSWBatteryStorage() {}
+    virtual bool    write(const char * key, const void * data, size_t len) = 0;
+    // returns the number of bytes read, 0 if there is no such record
+    virtual size_t  read(const char * key, void * data, size_t len) = 0;
+};
+
+#if defined(ESP32)
+/// @brief ESP32 NVS (through the Preferences library)
+class CSWBatteryNVSStorage : public CSWBatteryStorage {
+  public:
+    CSWBatteryNVSStorage(const char * name_space="cswbattery") : _namespace(name_space) {}
+    bool    write(const char * key, const void * data, size_t len);
+    size_t  read(const char * key, void * data, size_t len);
+  protected:
+    const char * _namespace;
+};
+#endif
+
+#if !defined(ARDUINO)
+/// @brief Files in the directory - for the Linux host builds
+class CSWBatteryFileStorage : public CSWBatteryStorage {
+  public:
+    CSWBatteryFileStorage(const char * dir=".") : _dir(dir) {}
+    bool    write(const char * key, const void * data, size_t len);
+    size_t  read(const char * key, void * data, size_t len);
+  protected:
+    const char * _dir;
+};
+#endif
+#endif
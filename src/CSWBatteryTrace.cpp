@@ -0,0 +1,209 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryTrace.cpp
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Recording of the raw ADC readings and its replay.
+  *
+  ******************************************************************************
+  */
+#include <string.h>
+#include "CSWBatteryTrace.h"
+#include "CSWBattery.h"
+#include "CSWBatteryHAL.h"
+
+// the longest entry: 5 bytes of the time varint + 5 bytes of the value
+static const size_t CSWBATTERY_TRACE_MAX_ENTRY = 10;
+
+static uint32_t CSWBatteryTrace_zigzag(int v) {
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int CSWBatteryTrace_unzigzag(uint32_t v) {
+  return (int)(v >> 1) ^ -(int)(v & 1);
+}
+
+/// @brief Start the recording from the beginning of the buffer
+/// @return false if the buffer can not hold even the header
+bool CSWBatteryTraceRecorder::begin(unsigned long tm, float battery_cf) {
+  if(_len < sizeof(batteryTraceHeader)) return false;
+  batteryTraceHeader __header;
+  memset(&__header, 0, sizeof(__header));
+  __header.magic = MAGIC;
+  __header.version = VERSION;
+  __header.flags = _config[0];
+  __header.check_times = _config[1];
+  __header.precision = _config[2];
+  __header.battery_cf = battery_cf;
+  __header.start_ms = tm;
+  memcpy(_buf, &__header, sizeof(__header));
+  _pos = sizeof(__header);
+  _last_ms = tm;
+  _last_raw = 0;
+  _dropped = 0;
+  _started = true;
+  return true;
+}
+
+/// @brief Settings of the battery for the header; the latest ones are kept
+void CSWBatteryTraceRecorder::setConfig(uint8_t flags, int check_times, int precision) {
+  _config[0] = flags;
+  _config[1] = (uint8_t)max(0, min(check_times, 255));
+  _config[2] = (uint8_t)max(0, min(precision, 255));
+  // the entries never touch the header - no need for the lock
+  if(_started) memcpy(_buf + offsetof(batteryTraceHeader, flags), _config, sizeof(_config));
+}
+
+bool CSWBatteryTraceRecorder::lock(void) {
+  if((!_started) || _busy.test_and_set(std::memory_order_acquire)) {
+    _dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  if(_len - _pos < CSWBATTERY_TRACE_MAX_ENTRY) {
+    this->unlock();
+    _dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+void CSWBatteryTraceRecorder::putVarint(uint32_t v) {
+  while(v >= 0x80) {
+    _buf[_pos++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  _buf[_pos++] = (uint8_t)v;
+}
+
+void CSWBatteryTraceRecorder::addSample(unsigned long tm, int raw) {
+  if(!this->lock()) return;
+  this->putVarint((uint32_t)(tm - _last_ms) * 2 + ENTRY_SAMPLE);
+  this->putVarint(CSWBatteryTrace_zigzag(raw - _last_raw));
+  _last_ms = tm;
+  _last_raw = raw;
+  this->unlock();
+}
+
+void CSWBatteryTraceRecorder::addMarker(unsigned long tm, uint8_t marker) {
+  if(!this->lock()) return;
+  this->putVarint((uint32_t)(tm - _last_ms) * 2 + ENTRY_MARKER);
+  _buf[_pos++] = marker;
+  _last_ms = tm;
+  this->unlock();
+}
+
+CSWBatteryTraceReader::CSWBatteryTraceReader(const uint8_t * buf, size_t len) : _buf(buf), _len(len) {
+  memset(&_header, 0, sizeof(_header));
+  if((buf == NULL) || (len < sizeof(batteryTraceHeader))) return;
+  memcpy(&_header, buf, sizeof(_header));
+  _valid = (_header.magic == CSWBatteryTraceRecorder::MAGIC) && (_header.version >= 1) && (_header.version <= CSWBatteryTraceRecorder::VERSION);
+  this->rewind();
+}
+
+void CSWBatteryTraceReader::rewind(void) {
+  _pos = sizeof(batteryTraceHeader);
+  _last_ms = _header.start_ms;
+  _last_raw = 0;
+}
+
+bool CSWBatteryTraceReader::getVarint(uint32_t& v) {
+  v = 0;
+  for(int __shift=0;__shift<35;__shift+=7) {
+    if(_pos >= _len) return false;
+    uint8_t __b = _buf[_pos++];
+    v |= (uint32_t)(__b & 0x7F) << __shift;
+    if(!(__b & 0x80)) return true;
+  }
+  return false;
+}
+
+bool CSWBatteryTraceReader::next(batteryTraceEntry& e) {
+  if(!_valid) return false;
+  uint32_t __v;
+  if(!this->getVarint(__v)) return false;
+  _last_ms += __v >> 1;
+  e.time_ms = _last_ms;
+  e.kind = __v & 1;
+  if(e.kind == CSWBatteryTraceRecorder::ENTRY_SAMPLE) {
+    if(!this->getVarint(__v)) return false;
+    _last_raw += CSWBatteryTrace_unzigzag(__v);
+    e.raw = _last_raw;
+  } else {
+    if(_pos >= _len) return false;
+    e.marker = _buf[_pos++];
+  }
+  return true;
+}
+
+#if !defined(ARDUINO)
+bool CSWBatteryTraceReplay::peek(void) {
+  if(!_has_pending) _has_pending = _reader.next(_pending);
+  return _has_pending;
+}
+
+// Readings of the tick come from the trace in the recorded order
+int CSWBatteryTraceReplay::source(void * param, int pin, uint64_t now_us) {
+  (void)pin;
+  (void)now_us;
+  CSWBatteryTraceReplay * __replay = static_cast<CSWBatteryTraceReplay *>(param);
+  if(__replay->peek() && (__replay->_pending.kind == CSWBatteryTraceRecorder::ENTRY_SAMPLE)) {
+    __replay->_last_raw = __replay->_pending.raw;
+    __replay->_has_pending = false;
+    __replay->_samples++;
+  } else {
+    __replay->_missing++;
+  }
+  return __replay->_last_raw;
+}
+
+unsigned long CSWBatteryTraceReplay::run(CSWBatteryReplayHandler handler, void * param) {
+  CSWBatterySim * __sim = CSWBatterySim::getCurrent();
+  _reader.rewind();
+  _has_pending = false;
+  _samples = 0;
+  _skipped = 0;
+  _missing = 0;
+  _battery.setBatteryCoefficient(_reader.getBatteryCoefficient());
+  if(_reader.checkIfConfigRecorded()) {
+    _battery.setBatteryCheckTimes(_reader.getBatteryCheckTimes());
+    _battery.setVoltagePrecision(_reader.getVoltagePrecision());
+    // the mode only - the sampling task is not started, the ticks come from the trace
+    _battery._getAvgData = _reader.checkIfAveraged();
+  }
+  __sim->setAdcSource(CSWBatteryTraceReplay::source, this);
+  // trace time = virtual time + offset
+  unsigned long __offset = _reader.getStartTime() - CSWBatteryHAL::getMillis();
+  BatterySnapshot __last;
+  unsigned long __ticks = 0;
+  while(this->peek()) {
+    _has_pending = false;
+    if(_pending.kind == CSWBatteryTraceRecorder::ENTRY_SAMPLE) {
+      _skipped++;
+      continue;
+    }
+    if(_pending.marker != CSWBatteryTraceRecorder::MARKER_TICK) continue;
+    unsigned long __trace_ms = _pending.time_ms;
+    unsigned long __tick_ms = __trace_ms - __offset;
+    unsigned long __now = CSWBatteryHAL::getMillis();
+    if((long)(__tick_ms - __now) > 0) __sim->advance(__tick_ms - __now);
+    // the recorded tick happened - it is not skipped for being too early after the previous one
+    _battery._refresh_requested = true;
+    _battery.tick();
+    __ticks++;
+    BatterySnapshot __s = _battery.getBatterySnapshot();
+    if(handler != NULL) {
+      batteryReplayEvent __e;
+      __e.time_ms = __trace_ms;
+      bool __first = (__last.timestamp == 0);
+      if(__first || (__s.percentage != __last.percentage)) { __e.type = EVENT_PERCENTAGE; __e.value = __s.percentage; handler(param, __e); }
+      if(__first || (__s.section != __last.section)) { __e.type = EVENT_SECTION; __e.value = __s.section; handler(param, __e); }
+      if(__first || (__s.charging != __last.charging)) { __e.type = EVENT_CHARGING; __e.value = __s.charging; handler(param, __e); }
+      if(__first || (__s.empty != __last.empty)) { __e.type = EVENT_EMPTY; __e.value = __s.empty; handler(param, __e); }
+    }
+    __last = __s;
+  }
+  __sim->setAdcSource(NULL);
+  return __ticks;
+}
+#endif
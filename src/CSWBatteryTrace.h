@@ -0,0 +1,144 @@
+/**
+  ******************************************************************************
+  * @file    CSWBatteryTrace.h
+  * @author  Eugene at sky.community
+  * @version V1.0.0
+  * @date    12-December-2022
+  * @brief   Compact recording of the raw ADC readings seen by CSWBattery (to
+  *          reproduce the field behaviour) and its replay on the Linux host.
+  *
+  ******************************************************************************
+  */
+#ifndef CSWBatteryTrace_h
+#define CSWBatteryTrace_h
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Format: 16 bytes of the header, then the entries. Every entry starts with the varint of
+// (milliseconds since the previous entry * 2 + kind); the sample goes on with the zigzag
+// varint of the raw value change, the marker - with one byte of its type.
+// A reading of the burst usually takes 2 bytes.
+struct batteryTraceHeader {
+  uint32_t      magic;
+  uint8_t       version;
+  uint8_t       flags;          // CSWBatteryTraceRecorder::FLAG_*; version 1 - reserved (0)
+  uint8_t       check_times;    // the settings of the battery the last time they changed; version 1 - 0
+  uint8_t       precision;
+  float         battery_cf;
+  uint32_t      start_ms;
+};
+
+struct batteryTraceEntry {
+  unsigned long time_ms=0;
+  uint8_t       kind=0;         // CSWBatteryTraceRecorder::ENTRY_*
+  int           raw=0;          // ENTRY_SAMPLE
+  uint8_t       marker=0;       // ENTRY_MARKER
+};
+
+/// @brief Appends to the given buffer - nothing is allocated. When the buffer is full
+/// (or the other task is appending at the same moment) the entry is dropped and counted.
+class CSWBatteryTraceRecorder {
+  public:
+    static const uint32_t MAGIC=0x54575343; // "CSWT"
+    static const uint8_t VERSION=2;
+    static const uint8_t ENTRY_SAMPLE=0;
+    static const uint8_t ENTRY_MARKER=1;
+    static const uint8_t MARKER_TICK=1;
+    static const uint8_t FLAG_AVERAGED=1;   // the data was collected (averageReceive)
+
+    CSWBatteryTraceRecorder(uint8_t * buf, size_t len) : _buf(buf), _len(len) {}
+    bool        begin(unsigned long tm, float battery_cf);
+    // how the battery reads the data - kept in the header, the replay is done the same way
+    void        setConfig(uint8_t flags, int check_times, int precision);
+    void        addSample(unsigned long tm, int raw);
+    void        addMarker(unsigned long tm, uint8_t marker);
+    const uint8_t * getData(void) const { return _buf; }
+    size_t      getSize(void) const { return _pos; }
+    uint32_t    getDroppedCount(void) const { return _dropped.load(std::memory_order_relaxed); }
+    bool        checkIfStarted(void) const { return _started; }
+  protected:
+    uint8_t *   _buf;
+    size_t      _len;
+    size_t      _pos=0;
+    bool        _started=false;
+    unsigned long _last_ms=0;
+    int         _last_raw=0;
+    uint8_t     _config[3]={};
+    std::atomic<uint32_t> _dropped{0};
+    std::atomic_flag _busy=ATOMIC_FLAG_INIT;
+
+    bool        lock(void);
+    void        unlock(void) { _busy.clear(std::memory_order_release); }
+    void        putVarint(uint32_t v);
+};
+
+class CSWBatteryTraceReader {
+  public:
+    CSWBatteryTraceReader(const uint8_t * buf, size_t len);
+    bool        checkIfValid(void) const { return _valid; }
+    float       getBatteryCoefficient(void) const { return _header.battery_cf; }
+    unsigned long getStartTime(void) const { return _header.start_ms; }
+    // the traces of version 1 do not tell how the battery read the data
+    bool        checkIfConfigRecorded(void) const { return _header.version >= 2; }
+    bool        checkIfAveraged(void) const { return _header.flags & CSWBatteryTraceRecorder::FLAG_AVERAGED; }
+    int         getBatteryCheckTimes(void) const { return _header.check_times; }
+    int         getVoltagePrecision(void) const { return _header.precision; }
+    // false at the end of the trace (or if it is broken)
+    bool        next(batteryTraceEntry& e);
+    void        rewind(void);
+  protected:
+    const uint8_t * _buf;
+    size_t      _len;
+    size_t      _pos=0;
+    bool        _valid=false;
+    batteryTraceHeader _header;
+    unsigned long _last_ms=0;
+    int         _last_raw=0;
+    bool        getVarint(uint32_t& v);
+};
+
+#if !defined(ARDUINO)
+class CSWBattery;
+
+struct batteryReplayEvent {
+  unsigned long time_ms;        // as in the trace
+  uint8_t       type;           // CSWBatteryTraceReplay::EVENT_*
+  int           value;
+};
+typedef void (*CSWBatteryReplayHandler) (void * param, const batteryReplayEvent& e);
+
+/// @brief Feeds the trace back through the battery on the simulator (CSWBatteryHAL.h):
+/// every recorded tick is repeated at its time, its ADC readings come from the trace.
+/// The coefficient, check times, precision and the way of reading the data (the collected
+/// average or the last tick) are the ones of the header; the rest of the settings have to be
+/// the recorded ones. The battery must not collect the data itself - the replay does the ticks.
+class CSWBatteryTraceReplay {
+  public:
+    static const uint8_t EVENT_PERCENTAGE=1;
+    static const uint8_t EVENT_SECTION=2;
+    static const uint8_t EVENT_CHARGING=3;
+    static const uint8_t EVENT_EMPTY=4;
+
+    CSWBatteryTraceReplay(CSWBattery& battery, CSWBatteryTraceReader& reader) : _battery(battery), _reader(reader) {}
+    // returns the number of the ticks replayed
+    unsigned long run(CSWBatteryReplayHandler handler=NULL, void * param=NULL);
+    unsigned long getSamplesCount(void) const { return _samples; }
+    // readings of the trace no tick asked for, and the readings the trace had no value for
+    unsigned long getSkippedCount(void) const { return _skipped; }
+    unsigned long getMissingCount(void) const { return _missing; }
+  protected:
+    CSWBattery& _battery;
+    CSWBatteryTraceReader& _reader;
+    batteryTraceEntry _pending;
+    bool        _has_pending=false;
+    int         _last_raw=0;
+    unsigned long _samples=0;
+    unsigned long _skipped=0;
+    unsigned long _missing=0;
+
+    bool        peek(void);
+    static int  source(void * param, int pin, uint64_t now_us);
+};
+#endif
+#endif